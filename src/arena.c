@@ -0,0 +1,118 @@
+/*
+ * src/arena.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <assert.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE 8192
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct arena_chunk {
+    arena_chunk* next;
+    size_t size;
+    size_t used;
+    alignas(ARENA_ALIGN) char data[];
+};
+
+static size_t align_up(size_t size)
+{
+    return (size + (ARENA_ALIGN-1)) & ~(ARENA_ALIGN-1);
+}
+
+static arena_chunk* new_chunk(size_t size)
+{
+    arena_chunk* chunk = malloc(sizeof(arena_chunk) + size);
+    assert(chunk);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void* arena_alloc(arena* a, size_t size)
+{
+    size = align_up(size ? size : 1);
+    arena_chunk* chunk = a->head;
+    if (chunk && chunk->size - chunk->used >= size)
+    {
+        void* ret = &chunk->data[chunk->used];
+        chunk->used += size;
+        return ret;
+    }
+    if (size > ARENA_CHUNK_SIZE/4)
+    {
+        // Large allocations get a chunk of their own, which is put after
+        // the current chunk, so that it can keep on serving small allocations.
+        arena_chunk* big = new_chunk(size);
+        big->used = size;
+        if (chunk)
+        {
+            big->next = chunk->next;
+            chunk->next = big;
+        }
+        else
+            a->head = big;
+        return big->data;
+    }
+    chunk = new_chunk(ARENA_CHUNK_SIZE);
+    chunk->next = a->head;
+    a->head = chunk;
+    chunk->used = size;
+    return chunk->data;
+}
+
+void* arena_realloc(arena* a, void* old, size_t old_size, size_t new_size)
+{
+    if (!old)
+        return arena_alloc(a, new_size);
+    arena_chunk* chunk = a->head;
+    old_size = align_up(old_size);
+    if (chunk && (char*)old + old_size == &chunk->data[chunk->used])
+    {
+        size_t offset = (char*)old - chunk->data;
+        if (chunk->size - offset >= new_size)
+        {
+            chunk->used = offset + align_up(new_size);
+            return old;
+        }
+    }
+    if (new_size <= old_size)
+        return old;
+    void* ret = arena_alloc(a, new_size);
+    memcpy(ret, old, old_size);
+    return ret;
+}
+
+char* arena_strndup(arena* a, const char* str, size_t len)
+{
+    char* ret = arena_alloc(a, len+1);
+    memcpy(ret, str, len);
+    ret[len] = 0;
+    return ret;
+}
+
+char* arena_strdup(arena* a, const char* str)
+{
+    return arena_strndup(a, str, strlen(str));
+}
+
+void arena_free(arena* a)
+{
+    arena_chunk* chunk = a->head;
+    while (chunk)
+    {
+        arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->head = NULL;
+}
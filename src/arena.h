@@ -0,0 +1,25 @@
+/*
+ * src/arena.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// A bump allocator, of which all allocations are freed at once.
+// NOTE: Not thread-safe.
+
+typedef struct arena_chunk arena_chunk;
+typedef struct arena {
+    arena_chunk* head;
+} arena;
+
+void* arena_alloc(arena* a, size_t size);
+// Grows the allocation in-place if it was the last one made, otherwise
+// the contents are copied to a new allocation (the old one is only reclaimed by arena_free).
+void* arena_realloc(arena* a, void* old, size_t old_size, size_t new_size);
+char* arena_strdup(arena* a, const char* str);
+char* arena_strndup(arena* a, const char* str, size_t len);
+void arena_free(arena* a);
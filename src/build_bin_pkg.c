@@ -59,18 +59,11 @@ static void create_pkg(package* pkg, bool build_dependencies)
         fprintf(stderr, "%s is not a directory\n", pkg->bin_package_prefix);
         return;
     }
-    if (chdir(pkg->bin_package_prefix) == -1)
-        abort();
-    remove("usr/share/info/dir");    
-#ifndef NDEBUG
-    printf("Entering directory %s\n", binary_package_directory);
-#endif
-    if (chdir(binary_package_directory) == -1)
-    {
-        unlock();
-        perror("chdir");
-        return;
-    }
+    size_t len_info_dir = snprintf(NULL, 0, "%s/usr/share/info/dir", pkg->bin_package_prefix);
+    char* info_dir = malloc(len_info_dir+1);
+    snprintf(info_dir, len_info_dir+1, "%s/usr/share/info/dir", pkg->bin_package_prefix);
+    remove(info_dir);
+    free(info_dir);
 
     command xbps_create_cmd = {.proc="xbps-create"};
     command xbps_rindex_cmd = {.proc="xbps-rindex"};
@@ -83,9 +76,10 @@ static void create_pkg(package* pkg, bool build_dependencies)
     char* package_version = malloc(package_version_len+1);
     snprintf(package_version, package_version_len+1, "%s-%d.%d_%d", pkg->name, pkg->version.major, pkg->version.minor, pkg->version.patch);
     
-    size_t len_package_filename = snprintf(NULL, 0, "%s.%s.xbps", package_version, architecture);
+    // The package is created in binary_package_directory.
+    size_t len_package_filename = snprintf(NULL, 0, "%s/%s.%s.xbps", binary_package_directory, package_version, architecture);
     char* package_filename = malloc(len_package_filename+1);
-    snprintf(package_filename, len_package_filename+1, "%s.%s.xbps", package_version, architecture);
+    snprintf(package_filename, len_package_filename+1, "%s/%s.%s.xbps", binary_package_directory, package_version, architecture);
     if (stat(package_filename, &st) == 0)
     {
         free(architecture);
@@ -139,8 +133,6 @@ static void create_pkg(package* pkg, bool build_dependencies)
         }
 
         depends_str_len += depend_expr_len+1;
-
-        free(depend_pkg);
     }
     if (depends_str_len)
         depends_str_len++;
@@ -191,8 +183,6 @@ static void create_pkg(package* pkg, bool build_dependencies)
             
             if (how_cmp == VERSION_CMP_NONE || how_cmp == VERSION_CMP_EQUAL)
                 free(depend_expr);
-
-            free(depend_pkg);
         }
         depends_str[depends_str_len-1] = 0;
     }
@@ -216,7 +206,7 @@ static void create_pkg(package* pkg, bool build_dependencies)
     free(package_version);
     free(depends_str);
 
-    int cmd_ret = run_command(xbps_create_cmd.proc, xbps_create_cmd.argv);
+    int cmd_ret = run_command_in(xbps_create_cmd.proc, xbps_create_cmd.argv, binary_package_directory);
 
     if (cmd_ret != 0)
     {
@@ -229,7 +219,7 @@ static void create_pkg(package* pkg, bool build_dependencies)
     string_array_append(&xbps_rindex_cmd.argv, "-a");
     string_array_append(&xbps_rindex_cmd.argv, package_filename);
 
-    cmd_ret = run_command(xbps_rindex_cmd.proc, xbps_rindex_cmd.argv);
+    cmd_ret = run_command_in(xbps_rindex_cmd.proc, xbps_rindex_cmd.argv, binary_package_directory);
     
     if (cmd_ret != 0)
     {
@@ -237,13 +227,8 @@ static void create_pkg(package* pkg, bool build_dependencies)
         goto done;
     }
 
-    free(package_filename);
-
     done:
-#ifndef NDEBUG
-    printf("Entering directory %s\n", root_directory);
-#endif
-    chdir(root_directory);
+    free(package_filename);
 }
 
 void build_binary_package(const char* name)
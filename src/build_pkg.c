@@ -14,11 +14,39 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "package.h"
 #include "path.h"
 #include "lock.h"
+#include "tree.h"
+#include "state_db.h"
+#include "manifest.h"
+#include "jobserver.h"
+#include "trace.h"
+
+// Returns dir/file, allocated with malloc.
+static char* make_path(const char* dir, const char* file)
+{
+    size_t len = snprintf(NULL, 0, "%s/%s", dir, file);
+    char* path = malloc(len+1);
+    snprintf(path, len+1, "%s/%s", dir, file);
+    return path;
+}
+
+// Adds the resources used by a process (see run_command_ex) to total.
+static void add_usage(struct rusage* total, const struct rusage* usage)
+{
+    if (usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+}
 
 #if HAS_LIBCURL
 
@@ -43,8 +71,7 @@ curl_handle init_curl()
 
 static char* download_archive(curl_handle hnd, const char* url)
 {
-    char *template = malloc(18);
-    memcpy(template, "obos-strap-XXXXXX", 18);
+    char *template = make_path(repo_directory, "obos-strap-XXXXXX");
     int fd = mkstemp(template);
     if (fd == -1)
     {
@@ -71,7 +98,7 @@ static char* download_archive(curl_handle hnd, const char* url)
     return template;
 }
 
-static bool extract_archive(const char* url, const char* name, char* archive_path)
+static bool extract_archive(const char* url, const char* name, char* archive_path, struct rusage* usage)
 {
     (void)(url && name);
     // TODO: Use a library?
@@ -79,7 +106,10 @@ static bool extract_archive(const char* url, const char* name, char* archive_pat
     string_array_append(&argv, "tar");
     string_array_append(&argv, "-xf");
     string_array_append(&argv, archive_path);
-    int ret = run_command("tar", argv);
+    struct rusage tar_usage = {};
+    int ret = run_command_ex("tar", argv, repo_directory, &tar_usage);
+    add_usage(usage, &tar_usage);
+    string_array_free(&argv);
     if (ret != EXIT_SUCCESS)
         printf("Could not run program 'tar'. Exit status: %d\n", ret);
     return ret == EXIT_SUCCESS;
@@ -95,45 +125,35 @@ static char* download_archive(curl_handle hnd, const char* url)
     printf("Could not download archive %s. You must build obos-strap with libcurl installed.\n", url);
     return NULL;
 }
-static bool extract_archive(const char* url, const char* name, char* archive_path)
+static bool extract_archive(const char* url, const char* name, char* archive_path, struct rusage* usage)
 {
     (void)(url);
     (void)(name);
     (void)(archive_path);
+    (void)(usage);
     return false;
 }
 #endif
 
 // Applies a patch 'patch_path' to the file 'modifies_path'
-// This is run in the initial CWD of the process.
-static bool apply_patch(const char* patch_path, const char* modifies_path)
+// patch_path is relative to the initial CWD of the process, and modifies_path to repo_directory.
+// What patch used is added to usage.
+static bool apply_patch(const char* patch_path, const char* modifies_path, struct rusage* usage)
 {
     char* patch = realpath(patch_path, NULL);
-    // printf("Entering directory %s\n", repo_directory);
-    if (chdir(repo_directory) == -1)
-    {
-        perror("chdir");
-        return false;
-    }
-    char* modifies = realpath(modifies_path, NULL);
+    char* modifies_in_repo = make_path(repo_directory, modifies_path);
+    char* modifies = realpath(modifies_in_repo, NULL);
 
     if (!modifies || !strlen(modifies))
     {
         // fprintf(stderr, "Could not find file to patch at %s/%s\n", repo_directory, modifies_path);
         // return false;
         // This behaviour is invalid, we should make the file path instead.
-        char* pwd = realpath(".", NULL);
-        size_t path_len = snprintf(NULL, 0, "%s/%s", pwd, modifies_path);
-        modifies = malloc(path_len+1);
-        snprintf(modifies, path_len + 1, "%s/%s", pwd, modifies_path);
-    }
-
-    // printf("Leaving directory %s\n", repo_directory);
-    if (chdir("..") == -1)
-    {
-        perror("chdir");
-        return false;
+        free(modifies);
+        modifies = modifies_in_repo;
     }
+    else
+        free(modifies_in_repo);
 
     if (!patch || !strlen(patch))
     {
@@ -149,7 +169,10 @@ static bool apply_patch(const char* patch_path, const char* modifies_path)
     string_array_append(&argv, "-i");
     string_array_append(&argv, patch);
     string_array_append(&argv, "-t");
-    bool res = !run_command(argv.buf[0], argv);
+    struct rusage patch_usage = {};
+    bool res = !run_command_ex(argv.buf[0], argv, NULL, &patch_usage);
+    add_usage(usage, &patch_usage);
+    string_array_free(&argv);
 
     free(modifies);
     free(patch);
@@ -158,14 +181,14 @@ static bool apply_patch(const char* patch_path, const char* modifies_path)
 
 void remove_recursively(const char* path);
 #if ENABLE_GIT
-static bool clone_repository(const char* pkg_name, const char* url, const char* hash)
+static bool clone_repository(const char* url, const char* hash, struct rusage* usage)
 {
     const char* dir_name = strrchr(url, '/')+1;
     string_array argv_rm = {};
     string_array_append(&argv_rm, "rm");
     string_array_append(&argv_rm, "-rf");
     string_array_append(&argv_rm, dir_name);
-    run_command("rm", argv_rm);
+    run_command_in("rm", argv_rm, repo_directory);
     string_array_free(&argv_rm);
 
     // TODO: Use a library?
@@ -177,48 +200,35 @@ static bool clone_repository(const char* pkg_name, const char* url, const char*
     string_array_append(&argv, url);
     string_array_append(&argv, "-b");
     string_array_append(&argv, hash);
-    int ret = run_command("git", argv);
+    struct rusage git_usage = {};
+    int ret = run_command_ex("git", argv, repo_directory, &git_usage);
+    add_usage(usage, &git_usage);
+    string_array_free(&argv);
     if (ret != EXIT_SUCCESS)
     {
         printf("Git failed with exit code %d\n", ret);
-#ifndef NDEBUG
-        printf("Leaving directory %s\n", pkg_name);
-#endif
-        if (chdir("..") == -1)
-        {
-            perror("chdir");
-            remove_recursively(pkg_name);
-            return false;
-        }
-        remove_recursively(pkg_name);
+        char* path = make_path(repo_directory, dir_name);
+        remove_recursively(path);
+        free(path);
         return false;
     }
 
-    string_array_free(&argv);
-    argv = (string_array){};
-
     return true;
 }
 #else
-static bool clone_repository(const char *pkg_name, const char* url, const char* hash)
+static bool clone_repository(const char* url, const char* hash, struct rusage* usage)
 {
+    (void)(url && hash && usage);
     printf("%s: FATAL: Compiled without git support enabled, and git repository package was found.\n", g_argv[0]);
     return false;
 }
 #endif
 
-static bool fetch(package* pkg, curl_handle curl_hnd)
+// What the processes fetching the package used is added to usage.
+// Downloads are done by this process, so they are not part of it.
+static bool fetch(package* pkg, curl_handle curl_hnd, struct rusage* usage)
 {
-    // Fetch the repository/archive.
-#ifndef NDEBUG
-    printf("Entering directory %s\n", repo_directory);
-#endif
-    if (chdir(repo_directory) == -1)
-    {
-        perror("chdir");
-        return false;
-    }
-
+    // Fetch the repository/archive into repo_directory.
     bool fetched = false;
 
     switch (pkg->source_type)
@@ -231,14 +241,14 @@ static bool fetch(package* pkg, curl_handle curl_hnd)
                 fetched = false;
                 break;
             }
-            fetched = extract_archive(pkg->source.web.url, pkg->name, archive);
+            fetched = extract_archive(pkg->source.web.url, pkg->name, archive, usage);
             remove(archive);
             free(archive);
             break;
         }
         case SOURCE_TYPE_GIT:
         {
-            fetched = clone_repository(pkg->name, pkg->source.git.git_url, pkg->source.git.git_commit);
+            fetched = clone_repository(pkg->source.git.git_url, pkg->source.git.git_commit, usage);
             break;
         }
         case SOURCE_TYPE_SOURCELESS:
@@ -250,16 +260,6 @@ static bool fetch(package* pkg, curl_handle curl_hnd)
             abort();
     }
 
-    done_fetch:
-#ifndef NDEBUG
-    printf("Leaving directory %s\n", repo_directory);
-#endif
-    if (chdir("..") == -1)
-    {
-        perror("chdir");
-        return false;
-    }
-
     return fetched;
 }
 
@@ -285,9 +285,69 @@ static void remove_bin_pkg(package* pkg)
     free(package_version);
 }
 
-bool build_pkg_internal(package* pkg, curl_handle curl_hnd, bool install, bool satisfy_dependencies);
+// A node in the dependency closure of the package being built.
+typedef struct resolve_node {
+    const char* name;
+    package* pkg;
+    // Set while the node's dependencies are being resolved, used to detect cycles.
+    bool visiting : 1;
+    // Set if the host already provides this package.
+    bool host_provided : 1;
+    RB_ENTRY(resolve_node) node;
+} resolve_node;
+
+typedef RB_HEAD(resolve_tree, resolve_node) resolve_tree;
 
-static bool build_dependencies(package* pkg, string_array* arr, curl_handle curl_hnd)
+static int cmp_resolve_nodes(resolve_node* lhs, resolve_node* rhs)
+{
+    return strcmp(lhs->name, rhs->name);
+}
+
+RB_GENERATE_STATIC(resolve_tree, resolve_node, node, cmp_resolve_nodes);
+
+// The dependency closure of a package, in topological order.
+typedef struct resolve_ctx {
+    resolve_tree visited;
+    resolve_node** order;
+    size_t nOrder;
+} resolve_ctx;
+
+static bool host_provides_package(package* pkg)
+{
+    if (!pkg->host_package)
+        return false;
+    package_load_commands(pkg);
+    if (!pkg->host_provides)
+        return false;
+    // Hopefully this doesn't hang.
+    string_array argv = {};
+    string_array_append(&argv, pkg->host_provides);
+    string_array_append(&argv, "-v");
+    int ec = run_command_supress_output(pkg->host_provides, argv);
+    string_array_free(&argv);
+    return !ec;
+}
+
+static void mark_host_provided(package* pkg)
+{
+    // printf("%s provided by host package %s is already installed from an external source. Assuming it works...\n", pkg->host_provides, pkg->name);
+    struct pkginfo* info = read_package_info(pkg->name);
+    info->build_state = BUILD_STATE_INSTALLED;
+
+    const char *triplet = pkg->host_package ? g_config.host_triplet : g_config.target_triplet;
+    info->host_triplet_len = strlen(triplet);
+    info = realloc(info, sizeof(*info) + info->host_triplet_len);
+    assert(info);
+    memcpy(info->host_triplet, triplet, info->host_triplet_len);
+    info->cross_compiled = g_config.cross_compiling;
+
+    write_package_info(pkg->name, info);
+    free(info);
+}
+
+static bool resolve_package(resolve_ctx* ctx, package* pkg);
+
+static bool resolve_dependencies(resolve_ctx* ctx, package* pkg, string_array* arr)
 {
     for (size_t i = 0; i < arr->cnt; i++)
     {
@@ -306,8 +366,12 @@ static bool build_dependencies(package* pkg, string_array* arr, curl_handle curl
         if (!depend_pkg)
         {
             printf("%s: While satisfying dependencies for package %s: Invalid or unknown package '%s'\nAbort.\n", g_argv[0], pkg->name, depend);
+            if (depend != depend_expr)
+                free(depend);
             return false;
         }
+        if (depend != depend_expr)
+            free(depend);
         if (strcmp(depend_pkg->name, pkg->name) == 0)
         {
             printf("%s: While satisfying dependencies for package %s: Recursive dependency.\nAbort.\n", g_argv[0], pkg->name);
@@ -323,51 +387,159 @@ static bool build_dependencies(package* pkg, string_array* arr, curl_handle curl
             );
             return false;
         }
-        if (depend != depend_expr)
-            free(depend);
-        if (!build_pkg_internal(depend_pkg, curl_hnd, true, true))
+        if (!resolve_package(ctx, depend_pkg))
+        {
+            printf("%s: While satisfying dependencies for package %s: Could not satisfy dependency %s.\n", g_argv[0], pkg->name, depend_pkg->name);
             return false;
+        }
     }
     return true;
 }
 
-bool build_pkg_internal(package* pkg, curl_handle curl_hnd, bool install, bool satisfy_dependencies)
+// Adds pkg and everything it depends on to ctx->order, each package at most once.
+// Dependencies always come before their dependants.
+static bool resolve_package(resolve_ctx* ctx, package* pkg)
 {
-    if (pkg->host_package && pkg->host_provides)
-    {
-        // Hopefully this doesn't hang.
-        string_array argv = {};
-        string_array_append(&argv, pkg->host_provides);
-        string_array_append(&argv, "-v");
-        int ec = run_command_supress_output(pkg->host_provides, argv);
-        if (!ec)
+    resolve_node what = {.name=pkg->name};
+    resolve_node* node = RB_FIND(resolve_tree, &ctx->visited, &what);
+    if (node)
+    {
+        if (node->visiting)
         {
-            // It exists.
-            // printf("%s provided by host package %s is already installed from an external source. Assuming it works...\n", pkg->host_provides, pkg->name);
-            struct pkginfo* info = read_package_info(pkg->name);
-            info->build_state = BUILD_STATE_INSTALLED;
-
-            const char *triplet = pkg->host_package ? g_config.host_triplet : g_config.target_triplet;
-            info->host_triplet_len = strlen(triplet);
-            info = realloc(info, sizeof(*info) + info->host_triplet_len);
-            assert(info);
-            memcpy(info->host_triplet, triplet, info->host_triplet_len);
-            info->cross_compiled = g_config.cross_compiling;
-
-            write_package_info(pkg->name, info);
-            return true;
+            printf("%s: Recursive dependency on package %s.\nAbort.\n", g_argv[0], pkg->name);
+            return false;
         }
+        return true;
     }
 
-    // Satisfy dependencies.
-    if (satisfy_dependencies)
+    node = calloc(1, sizeof(resolve_node));
+    assert(node);
+    node->name = pkg->name;
+    node->pkg = pkg;
+    node->visiting = true;
+    RB_INSERT(resolve_tree, &ctx->visited, node);
+
+    // If the host provides this package, then there is no need
+    // to build it, nor any of its dependencies.
+    node->host_provided = host_provides_package(pkg);
+    if (!node->host_provided)
     {
-        if (!build_dependencies(pkg, &pkg->build_depends, curl_hnd))
+        if (!resolve_dependencies(ctx, pkg, &pkg->build_depends))
             return false;
-        if (!build_dependencies(pkg, &pkg->depends, curl_hnd))
+        if (!resolve_dependencies(ctx, pkg, &pkg->depends))
             return false;
     }
 
+    node->visiting = false;
+    ctx->order = realloc(ctx->order, (ctx->nOrder+1)*sizeof(resolve_node*));
+    assert(ctx->order);
+    ctx->order[ctx->nOrder++] = node;
+    return true;
+}
+
+static void free_resolve_ctx(resolve_ctx* ctx)
+{
+    resolve_node *node = NULL, *next = NULL;
+    RB_FOREACH_SAFE(node, resolve_tree, &ctx->visited, next)
+    {
+        RB_REMOVE(resolve_tree, &ctx->visited, node);
+        free(node);
+    }
+    free(ctx->order);
+}
+
+static bool build_pkg_stages(package* pkg, curl_handle curl_hnd, bool install);
+
+// Builds pkg, and everything it depends on.
+// The dependency closure is computed once up front, so that packages that are
+// depended upon by several others are only checked (and built) once.
+static bool build_pkg_closure(package* pkg, curl_handle curl_hnd, bool install)
+{
+    resolve_ctx ctx = {.visited=RB_INITIALIZER(&ctx.visited)};
+    if (!resolve_package(&ctx, pkg))
+    {
+        free_resolve_ctx(&ctx);
+        return false;
+    }
+    bool res = true;
+    for (size_t i = 0; i < ctx.nOrder && res; i++)
+    {
+        resolve_node* node = ctx.order[i];
+        bool is_target = node->pkg == pkg;
+        if (node->host_provided)
+            mark_host_provided(node->pkg);
+        else
+            res = build_pkg_stages(node->pkg, curl_hnd, is_target ? install : true);
+    }
+    free_resolve_ctx(&ctx);
+    return res;
+}
+
+bool build_pkg_internal(package* pkg, curl_handle curl_hnd, bool install, bool satisfy_dependencies)
+{
+    // Only creates the jobserver when a single package is built, as build-all creates it up front.
+    jobserver_init();
+    // The token is the implicit job slot of the package's commands.
+    jobserver_acquire();
+    bool res = true;
+    if (satisfy_dependencies)
+        res = build_pkg_closure(pkg, curl_hnd, install);
+    else if (host_provides_package(pkg))
+        mark_host_provided(pkg);
+    else
+        res = build_pkg_stages(pkg, curl_hnd, install);
+    // Package info is only made durable once per call, rather than after every stage.
+    // In build-all, packages that finish at the same time share a single sync.
+    state_db_sync();
+    jobserver_release();
+    return res;
+}
+
+static pthread_mutex_t install_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timespec stage_start()
+{
+    struct timespec start = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    return start;
+}
+
+// Returns the time since start (see stage_start), in microseconds.
+static uint64_t stage_duration(struct timespec start)
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t us = (int64_t)(now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000;
+    return us > 0 ? (uint64_t)us : 1;
+}
+
+static uint64_t timeval_to_us(struct timeval tv)
+{
+    return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+// Records how long the stage resulting in state took, and what it used, if usage is not NULL.
+static void record_stage_usage(struct pkginfo* info, int state, struct timespec start, const struct rusage* usage)
+{
+    info->stage_durations[state-1] = stage_duration(start);
+    if (!usage)
+        return;
+    info->stage_max_rss[state-1] = usage->ru_maxrss;
+    info->stage_user_time[state-1] = timeval_to_us(usage->ru_utime);
+    info->stage_system_time[state-1] = timeval_to_us(usage->ru_stime);
+    info->stage_blocks_in[state-1] = usage->ru_inblock;
+    info->stage_blocks_out[state-1] = usage->ru_oublock;
+}
+
+// Fetches, configures, builds, and optionally installs pkg.
+// Does not touch pkg's dependencies.
+static bool build_pkg_stages(package* pkg, curl_handle curl_hnd, bool install)
+{
+    if (package_load_commands(pkg) != 0)
+    {
+        printf("%s: Could not load the commands of package %s\n", g_argv[0], pkg->name);
+        return false;
+    }
     struct pkginfo* info = read_package_info(pkg->name);
     if (!info->host_triplet_len)
     {
@@ -380,157 +552,208 @@ bool build_pkg_internal(package* pkg, curl_handle curl_hnd, bool install, bool s
         info->cross_compiled = g_config.cross_compiling;
         write_package_info(pkg->name, info);
     }
-    if (!pkg->inhibit_auto_rebuild && package_outdated(pkg, info, BUILD_STATE_BUILT + (int)install) && info->build_state >= BUILD_STATE_CONFIGURED)
+    if (!pkg->inhibit_auto_rebuild && info->build_state >= BUILD_STATE_FETCHED && package_outdated(pkg, info, BUILD_STATE_BUILT + (int)install))
     {
-        info->build_state = BUILD_STATE_CLEAN;
-        info->configure_date = (struct timeval){};
-        info->build_date = (struct timeval){};
-        info->install_date = (struct timeval){};
+        // Restart from the earliest stage whose inputs changed.
+        int state = package_invalidated_state(pkg, info);
+        if (state < info->build_state)
+        {
+            info->build_state = state;
+            for (int i = state < BUILD_STATE_CONFIGURED ? BUILD_STATE_CONFIGURED : state+1; i <= BUILD_STATE_INSTALLED; i++)
+                info->build_times[i - BUILD_STATE_CONFIGURED] = (struct timeval){};
+            write_package_info(pkg->name, info);
+            remove_bin_pkg(pkg);
+        }
+    }
+    uint64_t fingerprint = package_fingerprint(pkg);
+    uint64_t stage_fingerprints[BUILD_STATE_INSTALLED];
+    package_stage_fingerprints(pkg, stage_fingerprints);
+    if (!info->stage_fingerprints[BUILD_STATE_FETCHED-1] && info->build_state >= BUILD_STATE_FETCHED)
+    {
+        // Built before fingerprints were recorded, but up to date according to the recipe's
+        // modification time, so take the current fingerprints instead of rebuilding.
+        memcpy(info->stage_fingerprints, stage_fingerprints, info->build_state*sizeof(uint64_t));
+        info->fingerprint = fingerprint;
+        write_package_info(pkg->name, info);
+    }
+    if (!info->dependency_output_hash && info->build_state >= BUILD_STATE_CONFIGURED)
+    {
+        // Likewise, but for packages configured before outputs were hashed.
+        info->dependency_output_hash = package_dependency_output_hash(pkg);
         write_package_info(pkg->name, info);
-        remove_bin_pkg(pkg);
     }
     if (info->build_state < BUILD_STATE_FETCHED)
     {
-        if (!fetch(pkg, curl_hnd))
+        struct timespec start = stage_start();
+        // Includes the patches.
+        struct rusage usage = {};
+        bool fetched = fetch(pkg, curl_hnd, &usage);
+        trace_stage("fetch", pkg->name, start, fetched);
+        if (!fetched)
         {
             free(info);
             return false;
         }
-        for (size_t i = 0; i < pkg->patches.cnt; i++)
+        struct timespec patch_start = stage_start();
+        bool patched = true;
+        for (size_t i = 0; i < pkg->patches.cnt && patched; i++)
         {
             if (pkg->patches.buf[i].delete_file)
             {
-                chdir(repo_directory);
-                remove(pkg->patches.buf[i].modifies);
-                chdir("..");
-            }
-            if (!apply_patch(pkg->patches.buf[i].patch, pkg->patches.buf[i].modifies))
-            {
-                free(info);
-                return false;
+                char* path = make_path(repo_directory, pkg->patches.buf[i].modifies);
+                remove(path);
+                free(path);
             }
+            patched = apply_patch(pkg->patches.buf[i].patch, pkg->patches.buf[i].modifies, &usage);
+        }
+        if (pkg->patches.cnt)
+            trace_stage("patch", pkg->name, patch_start, patched);
+        if (!patched)
+        {
+            free(info);
+            return false;
         }
         info->build_state = BUILD_STATE_FETCHED;
         info->version = pkg->version;
+        info->fingerprint = fingerprint;
+        info->stage_fingerprints[BUILD_STATE_FETCHED-1] = stage_fingerprints[BUILD_STATE_FETCHED-1];
+        record_stage_usage(info, BUILD_STATE_FETCHED, start, &usage);
         write_package_info(pkg->name, info);
     }
 
-#ifndef NDEBUG
-    printf("Entering directory %s\n", bootstrap_directory);
-#endif
-    if (chdir(bootstrap_directory) == -1)
-    {
-        perror("chdir");
-        free(info);
-        return false;
-    }
-
+    // The stages are run in the package's build directory.
+    // Several packages can be built at once, so the process' working directory is left alone.
+    char* build_dir = make_path(bootstrap_directory, pkg->name);
     if (info->build_state < BUILD_STATE_CONFIGURED)
-        remove_recursively(pkg->name);
-    mkdir(pkg->name, 0777);
-    mkdir(package_make_bin_prefix(pkg), 0777);
-    
-#ifndef NDEBUG
-   printf("Entering directory %s\n", pkg->name);
-#endif
-    if (chdir(pkg->name) == -1)
+        remove_recursively(build_dir);
+    if (mkdir(build_dir, 0777) == -1 && errno != EEXIST)
     {
-        perror("chdir");
+        perror("mkdir");
+        free(build_dir);
         free(info);
         return false;
     }
+    mkdir(package_make_bin_prefix(pkg), 0777);
 
     if (info->build_state < BUILD_STATE_CONFIGURED)
     {
+        // Taken before running the commands, as that is what they see.
+        uint64_t dependency_output_hash = package_dependency_output_hash(pkg);
         // Run bootstrap commands.
+        struct timespec start = stage_start();
+        struct rusage usage = {};
         command* cmd = NULL;
-        int ec = command_array_run(&pkg->bootstrap_commands, &cmd);
+        int ec = command_array_run(&pkg->bootstrap_commands, build_dir, &usage, &cmd);
+        trace_stage("configure", pkg->name, start, ec == EXIT_SUCCESS || !cmd);
         if (ec != EXIT_SUCCESS && cmd)
         {
             printf("%s exited with code %d\n", cmd->proc, ec);
+            free(build_dir);
             free(info);
-#ifndef NDEBUG
-            printf("Leaving directory %s/%s\n", bootstrap_directory, pkg->name);
-#endif
-            if (chdir("../../") == -1)
-            {
-                perror("chdir");
-                return false;
-            }
-
             return false;
         }
 
         info->build_state = BUILD_STATE_CONFIGURED;
         gettimeofday(&info->configure_date, NULL);
         info->version = pkg->version;
+        info->fingerprint = fingerprint;
+        info->stage_fingerprints[BUILD_STATE_CONFIGURED-1] = stage_fingerprints[BUILD_STATE_CONFIGURED-1];
+        info->dependency_output_hash = dependency_output_hash;
+        record_stage_usage(info, BUILD_STATE_CONFIGURED, start, &usage);
         write_package_info(pkg->name, info);
     }
 
     if (info->build_state < BUILD_STATE_BUILT)
     {
         // Run build commands.
+        struct timespec start = stage_start();
+        struct rusage usage = {};
         command* cmd = NULL;
-        int ec = command_array_run(&pkg->build_commands, &cmd);
+        int ec = command_array_run(&pkg->build_commands, build_dir, &usage, &cmd);
+        trace_stage("build", pkg->name, start, ec == EXIT_SUCCESS || !cmd);
         if (ec != EXIT_SUCCESS && cmd)
         {
             printf("%s exited with code %d\n", cmd->proc, ec);
+            free(build_dir);
             free(info);
-#ifndef NDEBUG
-            printf("Leaving directory %s/%s\n", bootstrap_directory, pkg->name);
-#endif
-            if (chdir("../../") == -1)
-            {
-                perror("chdir");
-                return false;
-            }
-
             return false;
         }
 
         info->build_state = BUILD_STATE_BUILT;
         info->version = pkg->version;
+        info->fingerprint = fingerprint;
+        info->stage_fingerprints[BUILD_STATE_BUILT-1] = stage_fingerprints[BUILD_STATE_BUILT-1];
+        record_stage_usage(info, BUILD_STATE_BUILT, start, &usage);
         gettimeofday(&info->build_date, NULL);
         write_package_info(pkg->name, info);
     }
 
     if (info->build_state < BUILD_STATE_INSTALLED && install)
     {
-        // Run install commands.
-        command* cmd = NULL;
-        int ec = command_array_run(&pkg->install_commands, &cmd);
-        if (ec != EXIT_SUCCESS && cmd)
+        // Target packages are installed into their own staging directory, which is merged into
+        // destination_directory once their output was hashed, so they can be installed at once.
+        // Host packages install into host_prefix_directory directly, and so are installed one at
+        // a time, so that the files installed by one package do not end up in the manifest of another.
+        bool staged = !pkg->host_package;
+        bool shared_root = !staged && !pkg->supports_binary_packages;
+        if (staged)
         {
-            printf("%s exited with code %d\n", cmd->proc, ec);
-            free(info);
-#ifndef NDEBUG
-            printf("Leaving directory %s/%s\n", bootstrap_directory, pkg->name);
-#endif
-            if (chdir("../../") == -1)
+            char* staging_dir = package_make_staging_directory(pkg);
+            remove_recursively(staging_dir);
+            if (mkdir(staging_dir, 0777) == -1)
             {
-                perror("chdir");
+                perror("mkdir");
+                free(build_dir);
+                free(info);
                 return false;
             }
-
+        }
+        if (shared_root)
+            pthread_mutex_lock(&install_lock);
+        struct timespec install_start = {};
+#ifdef CLOCK_REALTIME_COARSE
+        // File timestamps come from the coarse clock, which can lag behind CLOCK_REALTIME.
+        clock_gettime(CLOCK_REALTIME_COARSE, &install_start);
+#else
+        clock_gettime(CLOCK_REALTIME, &install_start);
+#endif
+        // Run install commands.
+        struct timespec start = stage_start();
+        struct rusage usage = {};
+        command* cmd = NULL;
+        int ec = command_array_run(&pkg->install_commands, build_dir, &usage, &cmd);
+        bool ran = ec == EXIT_SUCCESS || !cmd;
+        uint64_t output_hash = 0;
+        if (ran)
+            output_hash = hash_install_output(pkg, &install_start);
+        if (shared_root)
+            pthread_mutex_unlock(&install_lock);
+        bool merged = !ran || !staged || merge_staging_directory(pkg);
+        if (staged)
+            remove_recursively(package_make_staging_directory(pkg));
+        trace_stage("install", pkg->name, start, ran && merged);
+        if (!ran || !merged)
+        {
+            if (!ran)
+                printf("%s exited with code %d\n", cmd->proc, ec);
+            else
+                printf("%s: Could not install %s into %s\n", g_argv[0], pkg->name, destination_directory);
+            free(build_dir);
+            free(info);
             return false;
         }
 
         info->build_state = BUILD_STATE_INSTALLED;
         info->version = pkg->version;
+        info->fingerprint = fingerprint;
+        info->stage_fingerprints[BUILD_STATE_INSTALLED-1] = stage_fingerprints[BUILD_STATE_INSTALLED-1];
+        info->output_hash = output_hash;
+        record_stage_usage(info, BUILD_STATE_INSTALLED, start, &usage);
         gettimeofday(&info->install_date, NULL);
         write_package_info(pkg->name, info);
     }
 
-#ifndef NDEBUG
-    printf("Leaving directory %s\n", bootstrap_directory);
-#endif
-    if (chdir("..") == -1)
-    {
-        perror("chdir");
-        free(info);
-        return false;
-    }
-
+    free(build_dir);
     free(info);
 
     return true;
@@ -607,9 +830,14 @@ void run_pkg(const char* name)
         cleanup_curl(curl_hnd);
     }
     free(info);
-    chdir(root_directory);
+    if (package_load_commands(pkg) != 0)
+    {
+        printf("%s: Could not load the commands of package %s\n", g_argv[0], pkg->name);
+        unlock();
+        return;
+    }
     printf("Running %s, '%s'.\n", pkg->name, pkg->description);
-    command_array_run(&pkg->run_commands, NULL);
+    command_array_run(&pkg->run_commands, root_directory, NULL, NULL);
     unlock();
 }
 
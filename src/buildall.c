@@ -12,124 +12,147 @@
 #include <assert.h>
 #include <pthread.h>
 #include <string.h>
-#include <dirent.h>
-#include <semaphore.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "package.h"
-#include "tree.h"
 #include "path.h"
 #include "lock.h"
+#include "recipe_cache.h"
+#include "parallel.h"
+#include "graph.h"
+#include "buildall.h"
+#include "jobserver.h"
+#include "trace.h"
+
+static package_graph* graph;
+// The packages to build, NULL if every package is to be built.
+static const uint64_t* selected;
+
+// Build state, indexed by pkg_id.
+static package** pkgs;
+static struct pkginfo** infos;
+// The amount of dependencies of each package that have yet to be built.
+static atomic_uint* missing_deps;
+// The upward rank of each package: how long the longest chain of builds starting at the
+// package (including itself) took last time, in microseconds.
+static uint64_t* ranks;
+// How long a package that was never built is assumed to take, in microseconds.
+static uint64_t cost_guess;
+// The dependency whose build queued each package, or PKG_ID_INVALID if it was queued up front.
+static pkg_id* released_by;
+// The packages that were built, and that failed to build.
+static uint64_t* built;
+static uint64_t* failed;
+// If false, no package is started once one fails.
+static bool keep_going;
+
+static bool is_selected(pkg_id id)
+{
+    return (!selected || bitset_test(selected, id)) && !bitset_test(graph->broken, id);
+}
 
-typedef struct package_list {
-    struct package_node_ex *head, *tail;
-    size_t nNodes;
-} package_list;
-
-typedef struct package_node_ex {
-    struct package_node_ex *next, *prev;
-    struct package_node *data;
-} package_node_ex;
-
-typedef struct package_node {
-    const char* name;
-    package* pkg;
-    struct pkginfo* info;
-
-    pthread_mutex_t dependants_mutex;
-    package_list dependants;
-    size_t missing_dep_count;
-
-    // packages_zero_dependencies list
-    struct package_node *next, *prev;
-
-    RB_ENTRY(package_node) node;
-} package_node;
-
-static void add_dependant(package_node* dependency, package_node* dependant)
+// Called in parallel, for every selected package.
+static void load_package(size_t i, void* udata)
 {
-    package_list* list = &dependency->dependants;
-    package_node_ex* node = calloc(1, sizeof(package_node_ex));
-    node->data = dependant;
-
-    if (!list->head)
-        list->head = node;
-    if (list->tail)
-        list->tail->next = node;
-    node->prev = list->tail;
-    list->tail = node;
-    list->nNodes++;
+    const pkg_id* ids = udata;
+    pkg_id id = ids[i];
+    const char* name = package_graph_name(graph, id);
+    pkgs[id] = get_package(name);
+    if (pkgs[id])
+        infos[id] = read_package_info(name);
 }
 
-typedef RB_HEAD(package_tree, package_node) package_tree;
-static package_tree packages;
+// Loads every selected package that can be built.
+// Recipes and package info are loaded in parallel.
+static void discover_packages()
+{
+    pkgs = calloc(graph->cnt ? graph->cnt : 1, sizeof(package*));
+    infos = calloc(graph->cnt ? graph->cnt : 1, sizeof(struct pkginfo*));
+    missing_deps = calloc(graph->cnt ? graph->cnt : 1, sizeof(atomic_uint));
+
+    pkg_id* to_load = malloc((graph->cnt ? graph->cnt : 1)*sizeof(pkg_id));
+    size_t nToLoad = 0;
+    for (pkg_id id = 0; id < graph->cnt; id++)
+        if (is_selected(id))
+            to_load[nToLoad++] = id;
+    parallel_for(nToLoad, load_package, to_load);
+    for (size_t i = 0; i < nToLoad; i++)
+    {
+        if (pkgs[to_load[i]])
+            continue;
+        printf("Warning: Could not get package '%s'\n", package_graph_name(graph, to_load[i]));
+        package_graph_mark_broken(graph, to_load[i]);
+    }
+    free(to_load);
 
-// Packages with zero dependencies.
-static struct {
-    package_node *head, *tail;
-    size_t nNodes;
-} packages_zero_dependencies;
+    // Dependencies that are not selected are assumed to be up to date.
+    for (pkg_id id = 0; id < graph->cnt; id++)
+    {
+        unsigned cnt = 0;
+        for (uint32_t e = graph->dep_offsets[id]; e < graph->dep_offsets[id+1]; e++)
+            cnt += is_selected(graph->deps[e]);
+        atomic_init(&missing_deps[id], cnt);
+    }
+}
 
-static int cmp_package_nodes(package_node* lhs, package_node* rhs)
+// How long building the package took last time, or guess if it was never built.
+static uint64_t package_cost(pkg_id id, uint64_t guess)
 {
-    assert(lhs->name);
-    assert(rhs->name);
-    return strcmp(lhs->name, rhs->name);
+    uint64_t cost = 0;
+    if (infos[id])
+        for (int i = 0; i < BUILD_STATE_INSTALLED; i++)
+            cost += infos[id]->stage_durations[i];
+    return cost ? cost : guess;
 }
 
-RB_GENERATE_STATIC(package_tree, package_node, node, cmp_package_nodes);
-
-static package_node* make_package_node(const char* pkg, package_node* parent)
+// Computes the rank of every selected package, from the durations of previous builds.
+static void compute_ranks()
 {
-    package_node what = {.name=pkg};
-    package_node* found = RB_FIND(package_tree, &packages, &what);
-    if (found)
-        return found;
-
-    package* pkg_parsed = get_package(pkg);
-    if (!pkg_parsed)
-        return NULL;
-    struct pkginfo* info = read_package_info(pkg);
+    ranks = calloc(graph->cnt ? graph->cnt : 1, sizeof(uint64_t));
 
-    package_node* node = calloc(1, sizeof(package_node));
-    assert(node);
-    pthread_mutex_init(&node->dependants_mutex, NULL);
-    node->name = pkg;
-    node->pkg = pkg_parsed;
-    node->info = info;
-
-    for (size_t i = 0; i < node->pkg->depends.cnt; i++)
+    // Packages that were never built are assumed to take as long as the average package.
+    uint64_t total = 0;
+    size_t nKnown = 0;
+    for (pkg_id id = 0; id < graph->cnt; id++)
     {
-        char* dependency = node->pkg->depends.buf[i];
-        if (parent && (strcmp(parent->name, dependency) == 0))
-        {
-            printf("%s: Recursive dependency %s<->%s. Dropping packages.", g_argv[0], parent->name, dependency);
-            pthread_mutex_destroy(&node->dependants_mutex);
-            free(node);
-            return NULL;
-        }
-        what = (package_node){.name=dependency};
-        package_node* dependency_node = make_package_node(dependency, node);
-        node->missing_dep_count++;
-        pthread_mutex_lock(&dependency_node->dependants_mutex);
-        add_dependant(dependency_node, node);
-        pthread_mutex_unlock(&dependency_node->dependants_mutex);
-
+        uint64_t cost = is_selected(id) ? package_cost(id, 0) : 0;
+        total += cost;
+        nKnown += !!cost;
     }
+    uint64_t guess = nKnown ? total / nKnown : 1;
+    cost_guess = guess;
 
-    if (!node->pkg->depends.cnt)
+    // Dependants come after their dependencies in topological order.
+    for (size_t i = graph->nTopo; i--; )
     {
-        if (!packages_zero_dependencies.head)
-            packages_zero_dependencies.head = node;
-        if (packages_zero_dependencies.tail)
-            packages_zero_dependencies.tail->next = node;
-        node->prev = packages_zero_dependencies.tail;
-        packages_zero_dependencies.tail = node;
-        packages_zero_dependencies.nNodes++;
+        pkg_id id = graph->topo[i];
+        if (!is_selected(id))
+            continue;
+        uint64_t longest = 0;
+        for (uint32_t e = graph->rdep_offsets[id]; e < graph->rdep_offsets[id+1]; e++)
+        {
+            pkg_id dependant = graph->rdeps[e];
+            if (is_selected(dependant) && ranks[dependant] > longest)
+                longest = ranks[dependant];
+        }
+        ranks[id] = package_cost(id, guess) + longest;
     }
+}
 
-    RB_INSERT(package_tree, &packages, node);
-    return node;
+static void free_packages()
+{
+    for (pkg_id id = 0; id < graph->cnt; id++)
+        free(infos[id]);
+    free(pkgs);
+    free(infos);
+    free(missing_deps);
+    free(ranks);
+    pkgs = NULL;
+    infos = NULL;
+    missing_deps = NULL;
+    ranks = NULL;
 }
 
 #if HAS_LIBCURL
@@ -149,119 +172,449 @@ typedef int curl_handle;
 
 bool build_pkg_internal(package* pkg, curl_handle curl_hnd, bool install, bool satisfy_dependencies);
 
-sem_t awake_threads;
+// The scheduler: a fixed pool of workers that take packages off a queue of packages
+// whose dependencies have all been built.
+// Packages on the critical path go first: the queue is a max-heap ordered by rank.
+// A package is only started while the resources it needs (see package_resources) fit
+// in what the packages being built leave of the machine.
+// If the highest ranked package does not fit, lower ranked packages are only started
+// if they are expected to be done by the time it does, so that they do not delay it.
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a package is queued, when resources are freed, or when the build is done.
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+// Every package is queued at most once, so this has room for every package.
+static pkg_id* ready_queue;
+static size_t nReady;
+// The packages being built, and when each is expected to be done (see now_us).
+static pkg_id* building;
+static size_t nBuilding;
+static uint64_t* expected_end;
+// Set when a package fails to build, unless keep_going is set.
+static bool stopping;
+
+typedef struct resources {
+    // In KiB.
+    uint64_t memory;
+    uint64_t cpus;
+} resources;
+// What the machine has, and what the packages being built use.
+static resources machine_resources, used_resources;
+
+// The resources that the recipe declares, or else an estimate of what the package used the
+// last time it was built.
+// Must only be called once machine_resources is initialized.
+static resources package_resources(pkg_id id)
+{
+    package* pkg = pkgs[id];
+    resources res = {.memory=(uint64_t)pkg->memory*1024, .cpus=pkg->cpu_weight ? pkg->cpu_weight : 1};
+    if (!infos[id] || (pkg->memory && pkg->cpu_weight))
+        return res;
+    for (int i = 0; i < BUILD_STATE_INSTALLED; i++)
+    {
+        // The CPUs a stage kept busy is the CPU time it took over how long it took.
+        uint64_t wall = infos[id]->stage_durations[i];
+        uint64_t cpu = infos[id]->stage_user_time[i] + infos[id]->stage_system_time[i];
+        uint64_t cpus = wall ? (cpu + wall - 1) / wall : 1;
+        if (!cpus)
+            cpus = 1;
+        if (cpus > machine_resources.cpus)
+            cpus = machine_resources.cpus;
+        if (!pkg->cpu_weight && cpus > res.cpus)
+            res.cpus = cpus;
+        // The peak RSS is that of the largest process the stage ran, but a stage that kept
+        // several CPUs busy (e.g., make with several jobs) ran as many such processes at once.
+        uint64_t memory = (uint64_t)infos[id]->stage_max_rss[i] * cpus;
+        if (!pkg->memory && memory > res.memory)
+            res.memory = memory;
+    }
+    return res;
+}
 
-static bool build_pkg_and_dependants(package_node* node, curl_handle curl_hnd);
+static void init_machine_resources()
+{
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    machine_resources.cpus = nproc > 0 ? (uint64_t)nproc : 1;
+    // If the amount of memory is unknown, it is not limited.
+    machine_resources.memory = pages > 0 && page_size > 0 ? (uint64_t)pages*(uint64_t)page_size/1024 : UINT64_MAX;
+    used_resources = (resources){};
+}
 
-static void *build_thread(void* udata)
+// Returns true if id fits in what the packages being built leave of the machine, once
+// the resources in freed are given back.
+static bool fits_after(pkg_id id, resources freed)
 {
-    curl_handle curl_hnd = init_curl();
-    if (!curl_hnd)
+    resources res = package_resources(id);
+    return used_resources.memory - freed.memory + res.memory <= machine_resources.memory &&
+           used_resources.cpus - freed.cpus + res.cpus <= machine_resources.cpus;
+}
+
+static bool fits(pkg_id id)
+{
+    return fits_after(id, (resources){});
+}
+
+// In microseconds, from CLOCK_MONOTONIC.
+static uint64_t now_us()
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+static int cmp_expected_end(const void* lhs, const void* rhs)
+{
+    uint64_t l = expected_end[*(const pkg_id*)lhs], r = expected_end[*(const pkg_id*)rhs];
+    return l < r ? -1 : l > r;
+}
+
+// Returns when enough packages being built are expected to be done for id to fit.
+// Must be called with sched_lock held.
+static uint64_t expected_fit_time(pkg_id id)
+{
+    pkg_id* by_end = malloc(nBuilding*sizeof(pkg_id));
+    memcpy(by_end, building, nBuilding*sizeof(pkg_id));
+    qsort(by_end, nBuilding, sizeof(pkg_id), cmp_expected_end);
+    resources freed = {};
+    uint64_t time = 0;
+    // Once every package being built is done, id is started whether it fits or not.
+    for (size_t i = 0; i < nBuilding; i++)
     {
-        printf("curl_easy_init failed\n");
-        return (void*)(uintptr_t)false;
+        resources res = package_resources(by_end[i]);
+        freed.memory += res.memory;
+        freed.cpus += res.cpus;
+        time = expected_end[by_end[i]];
+        if (fits_after(id, freed))
+            break;
     }
-    void* res = (void*)(uintptr_t)!!build_pkg_and_dependants(udata, curl_hnd);
-    cleanup_curl(curl_hnd);
-    sem_post(&awake_threads);
-    return res;
+    free(by_end);
+    return time;
+}
+
+static bool ready_before(pkg_id lhs, pkg_id rhs)
+{
+    if (ranks[lhs] != ranks[rhs])
+        return ranks[lhs] > ranks[rhs];
+    return lhs < rhs;
+}
+
+static void sift_up(size_t i)
+{
+    pkg_id id = ready_queue[i];
+    for (size_t parent = 0; i; i = parent)
+    {
+        parent = (i-1)/2;
+        if (!ready_before(id, ready_queue[parent]))
+            break;
+        ready_queue[i] = ready_queue[parent];
+    }
+    ready_queue[i] = id;
+}
+
+static void sift_down(size_t i)
+{
+    pkg_id id = ready_queue[i];
+    while (true)
+    {
+        size_t child = i*2+1;
+        if (child >= nReady)
+            break;
+        if (child+1 < nReady && ready_before(ready_queue[child+1], ready_queue[child]))
+            child++;
+        if (!ready_before(ready_queue[child], id))
+            break;
+        ready_queue[i] = ready_queue[child];
+        i = child;
+    }
+    ready_queue[i] = id;
+}
+
+// Must be called with sched_lock held.
+static void queue_package(pkg_id id)
+{
+    ready_queue[nReady++] = id;
+    sift_up(nReady-1);
+    pthread_cond_signal(&sched_cond);
 }
 
-static bool build_pkg_and_dependants(package_node* node, curl_handle curl_hnd)
+// Must be called with sched_lock held.
+static pkg_id remove_ready_package(size_t i)
 {
-    bool res = build_pkg_internal(node->pkg, curl_hnd, true, false);
-    if (!res)
+    pkg_id id = ready_queue[i];
+    ready_queue[i] = ready_queue[--nReady];
+    if (i < nReady)
+    {
+        sift_down(i);
+        sift_up(i);
+    }
+    return id;
+}
+
+// Takes the highest ranked package that fits, and accounts for it as being built.
+// A package is always started if nothing else is being built, even if it does not fit,
+// as it would never fit otherwise.
+// Returns false if no package can be started.
+// Must be called with sched_lock held.
+static bool take_ready_package(pkg_id* out)
+{
+    if (!nReady)
         return false;
-    for (package_node_ex* curr = node->dependants.head; curr; )
+    size_t best = SIZE_MAX;
+    uint64_t now = now_us();
+    if (!nBuilding || fits(ready_queue[0]))
+        best = 0;
+    else
     {
-        package_node* const data = curr->data;
-        curr = curr->next;
-        if (!(--data->missing_dep_count))
+        // Packages that would still be building once the highest ranked package fits would
+        // take the resources it is waiting for.
+        // If packages run late, this is in the past, and nothing else is started.
+        uint64_t deadline = expected_fit_time(ready_queue[0]);
+        for (size_t i = 1; i < nReady; i++)
         {
-            int val = 0;
-            sem_getvalue(&awake_threads, &val);
-            if (val)
-            {
-                if (sem_trywait(&awake_threads) != 0)
-                    goto no_thread;
-                pthread_t thr_id = {};
-                // We can now start a thread.
-                int ec = pthread_create(&thr_id,
-                                        NULL,
-                                        build_thread, data);
-                if (ec)
-                {
-                    perror("pthread_create");
-                    fprintf(stderr, "Ignoring error.\n");
-                    goto no_thread;
-                }
-                pthread_detach(thr_id);
-                continue;
-            }
-            no_thread:
-            res = build_pkg_and_dependants(data, curl_hnd);
-            if (!res)
-                break;
-            continue;
+            pkg_id id = ready_queue[i];
+            if ((best == SIZE_MAX || ready_before(id, ready_queue[best])) && fits(id) &&
+                now + package_cost(id, cost_guess) <= deadline)
+                best = i;
         }
-        (void)0;
+        if (best == SIZE_MAX)
+            return false;
     }
-    return res;
+    *out = remove_ready_package(best);
+    resources res = package_resources(*out);
+    used_resources.memory += res.memory;
+    used_resources.cpus += res.cpus;
+    building[nBuilding++] = *out;
+    expected_end[*out] = now + package_cost(*out, cost_guess);
+    return true;
 }
 
-void buildall()
+// Gives back the resources of a package that was built, or failed to.
+// Must be called with sched_lock held.
+static void finish_building(pkg_id id)
 {
-    lock();
-
-    // Discover packages for dependency graph.
-    DIR* dir = opendir(recipes_directory);
-    if (!dir)
+    for (size_t i = 0; i < nBuilding; i++)
     {
-        perror("opendir");
-        unlock();
-        return;
+        if (building[i] != id)
+            continue;
+        building[i] = building[--nBuilding];
+        break;
     }
+    resources used = package_resources(id);
+    used_resources.memory -= used.memory;
+    used_resources.cpus -= used.cpus;
+}
 
-    struct dirent* ent = NULL;
-    do {
-        ent = readdir(dir);
-        if (!ent)
-            break;
-        const char* pos_extension = strstr(ent->d_name, ".json");
-        if (!pos_extension)
+// Called after a package was built.
+// Must be called with sched_lock held.
+static void release_dependants(pkg_id id)
+{
+    for (uint32_t e = graph->rdep_offsets[id]; e < graph->rdep_offsets[id+1]; e++)
+    {
+        const pkg_id dependant = graph->rdeps[e];
+        if (!is_selected(dependant))
             continue;
-        size_t pkg_len = pos_extension-ent->d_name;
-        char* pkg_name = memcpy(malloc(pkg_len+1), ent->d_name, pkg_len);
-        pkg_name[pkg_len] = 0;
-        make_package_node(pkg_name, NULL);
-    } while(ent);
+        if (atomic_fetch_sub(&missing_deps[dependant], 1) == 1)
+        {
+            released_by[dependant] = id;
+            trace_flow_start(dependant, package_graph_name(graph, id), package_graph_name(graph, dependant), trace_now());
+            queue_package(dependant);
+        }
+    }
+}
 
+// udata is the worker's lane in the trace.
+static void *build_worker(void* udata)
+{
+    trace_set_lane((uintptr_t)udata, "worker");
     curl_handle curl_hnd = init_curl();
     if (!curl_hnd)
     {
         printf("curl_easy_init failed\n");
-        unlock();
-        return;
+        return NULL;
     }
+    pthread_mutex_lock(&sched_lock);
+    while (true)
+    {
+        pkg_id id = 0;
+        bool done = false;
+        while (stopping || !take_ready_package(&id))
+        {
+            // Nothing is queued (or will be started), and nothing being built can queue anything else.
+            if ((stopping || !nReady) && !nBuilding)
+            {
+                done = true;
+                break;
+            }
+            pthread_cond_wait(&sched_cond, &sched_lock);
+        }
+        if (done)
+            break;
+        pthread_mutex_unlock(&sched_lock);
+
+        const char* name = package_graph_name(graph, id);
+        const char* dependency = released_by[id] != PKG_ID_INVALID ? package_graph_name(graph, released_by[id]) : NULL;
+        uint64_t start = trace_now();
+        if (dependency)
+            trace_flow_end(id, dependency, name, start);
+        bool res = build_pkg_internal(pkgs[id], curl_hnd, true, false);
+
+        pthread_mutex_lock(&sched_lock);
+        finish_building(id);
+        // The dependants of packages that failed to build are never queued.
+        if (res)
+        {
+            bitset_set(built, id);
+            release_dependants(id);
+        }
+        else
+        {
+            bitset_set(failed, id);
+            stopping = !keep_going;
+        }
+        // Ends after the dependants were released, so that the flows start inside the span.
+        trace_package(name, start, dependency, res);
+        // Waiting workers might be able to start a package with the freed resources, or be done.
+        pthread_cond_broadcast(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    cleanup_curl(curl_hnd);
+    return NULL;
+}
+
+// Prints the names of the packages in set, after header, if there are any.
+static void print_package_set(const uint64_t* set, const char* header)
+{
+    size_t cnt = 0;
+    for (pkg_id id = 0; id < graph->cnt; id++)
+        cnt += bitset_test(set, id);
+    if (!cnt)
+        return;
+    printf(header, cnt);
+    for (pkg_id id = 0; id < graph->cnt; id++)
+        if (bitset_test(set, id))
+            printf(" %s", package_graph_name(graph, id));
+    putchar('\n');
+}
 
-    int nproc = sysconf(_SC_NPROCESSORS_ONLN);
-    sem_init(&awake_threads, 0, nproc);
-    sem_wait(&awake_threads);
-    for (package_node* node = packages_zero_dependencies.head; node; )
+// Prints the packages that failed, and those that were not built because of them.
+// Returns false if any package failed.
+static bool print_summary()
+{
+    bool any_failed = false;
+    for (size_t i = 0; i < BITSET_WORDS(graph->cnt) && !any_failed; i++)
+        any_failed = failed[i] != 0;
+    if (!any_failed)
+        return true;
+
+    // Everything that depends on a package that failed.
+    uint64_t* blocked = bitset_alloc(graph->cnt);
+    memcpy(blocked, failed, BITSET_WORDS(graph->cnt)*sizeof(uint64_t));
+    package_graph_reverse_closure(graph, blocked);
+    // Without keep_going, packages that could have been built were left alone as well.
+    uint64_t* skipped = bitset_alloc(graph->cnt);
+    for (pkg_id id = 0; id < graph->cnt; id++)
     {
-        build_pkg_and_dependants(node, curl_hnd);
+        if (bitset_test(failed, id) || !is_selected(id))
+            bitset_clear(blocked, id);
+        else if (!bitset_test(blocked, id) && !bitset_test(built, id))
+            bitset_set(skipped, id);
+    }
+
+    print_package_set(failed, "%zu package(s) failed to build:");
+    print_package_set(blocked, "%zu package(s) were not built, as they depend on one that failed:");
+    print_package_set(skipped, "%zu package(s) were not built, as the build stopped after the first failure (use keep-going to build them anyway):");
+    free(blocked);
+    free(skipped);
+    return false;
+}
 
-        node = node->next;
+bool build_package_set(package_graph* g, const uint64_t* set, bool keep_going_after_failure)
+{
+    graph = g;
+    selected = set;
+    keep_going = keep_going_after_failure;
+
+    // Discover packages for dependency graph.
+    discover_packages();
+
+    compute_ranks();
+    // Before any worker runs a command, as this changes the environment.
+    jobserver_init();
+
+    ready_queue = malloc((graph->cnt ? graph->cnt : 1)*sizeof(pkg_id));
+    released_by = malloc((graph->cnt ? graph->cnt : 1)*sizeof(pkg_id));
+    for (pkg_id id = 0; id < graph->cnt; id++)
+        released_by[id] = PKG_ID_INVALID;
+    nReady = 0;
+    building = malloc((graph->cnt ? graph->cnt : 1)*sizeof(pkg_id));
+    expected_end = calloc(graph->cnt ? graph->cnt : 1, sizeof(uint64_t));
+    nBuilding = 0;
+    stopping = false;
+    built = bitset_alloc(graph->cnt);
+    failed = bitset_alloc(graph->cnt);
+    init_machine_resources();
+    for (size_t i = 0; i < graph->nTopo; i++)
+    {
+        pkg_id id = graph->topo[i];
+        if (is_selected(id) && !atomic_load(&missing_deps[id]))
+            queue_package(id);
     }
-    sem_post(&awake_threads);
-    int awake_thread_count = 0;
-    do {
-        // sem_wait(&awake_threads);
-        sem_getvalue(&awake_threads, &awake_thread_count);
-    } while(awake_thread_count != nproc);
-    sem_destroy(&awake_threads);
 
-    cleanup_curl(curl_hnd);
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nWorkers = nproc > 0 ? (size_t)nproc : 1;
+    pthread_t* workers = malloc(nWorkers*sizeof(pthread_t));
+    size_t nStarted = 0;
+    for (; nStarted < nWorkers; nStarted++)
+    {
+        if (pthread_create(&workers[nStarted], NULL, build_worker, (void*)(uintptr_t)(nStarted+1)) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+    }
+    // Build on this thread if no worker could be started.
+    if (!nStarted)
+        build_worker(NULL);
+    for (size_t i = 0; i < nStarted; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    free(ready_queue);
+    ready_queue = NULL;
+    free(building);
+    free(expected_end);
+    building = NULL;
+    expected_end = NULL;
+    free(released_by);
+    released_by = NULL;
+    bool res = print_summary();
+    free(built);
+    free(failed);
+    built = NULL;
+    failed = NULL;
+    free_packages();
+    return res;
+}
 
+bool buildall(const char* trace_path, bool keep_going_after_failure)
+{
+    lock();
+    if (trace_path && !trace_open(trace_path))
+    {
+        printf("%s: Could not open %s to write the trace to\n", g_argv[0], trace_path);
+        unlock();
+        return false;
+    }
+    package_graph g = {};
+    package_graph_init(&g, get_recipe_index());
+    bool res = build_package_set(&g, NULL, keep_going_after_failure);
+    package_graph_free(&g);
+    if (trace_path)
+    {
+        trace_close();
+        printf("Wrote the trace of the build to %s\n", trace_path);
+    }
     unlock();
+    return res;
 }
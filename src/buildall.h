@@ -0,0 +1,24 @@
+/*
+ * src/buildall.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "graph.h"
+
+// Builds and installs every package in set (or every package in g, if set is NULL) that is
+// not broken, in dependency order, building independent packages in parallel.
+// Dependencies that are not in set are assumed to be up to date.
+// When a package fails to build, its dependants are not built. Every other package is still
+// built if keep_going is true, otherwise no more packages are started.
+// Prints the packages that failed, and those that were not built, and returns false if any failed.
+// The caller must hold the lock.
+bool build_package_set(package_graph* g, const uint64_t* set, bool keep_going);
+// Builds and installs every package.
+// If trace_path is not NULL, a timeline of the build is written to it (see trace.h).
+// Returns false if any package failed to build.
+bool buildall(const char* trace_path, bool keep_going);
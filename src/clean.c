@@ -14,6 +14,7 @@
 
 #include "path.h"
 #include "package.h"
+#include "state_db.h"
 
 void remove_recursively(const char* path)
 {
@@ -27,12 +28,15 @@ void remove_recursively(const char* path)
 
 void clean()
 {
+    state_db_close();
     remove_recursively(pkg_info_directory);
     remove_recursively(bootstrap_directory);
     remove_recursively(destination_directory);
     remove_recursively(binary_package_directory);
     remove_recursively(host_prefix_directory);
     remove_recursively(repo_directory);
+    if (recipe_cache_directory)
+        remove_recursively(recipe_cache_directory);
     if (mkdir(destination_directory, 0755) == -1)
     {
         perror("mkdir");
@@ -63,4 +67,9 @@ void clean()
         perror("mkdir");
         return;
     }
+    if (recipe_cache_directory && mkdir(recipe_cache_directory, 0755) == -1)
+    {
+        perror("mkdir");
+        return;
+    }
 }
@@ -12,10 +12,19 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include "package.h"
 
 int run_command(const char* proc, string_array argv)
+{
+    return run_command_in(proc, argv, NULL);
+}
+int run_command_in(const char* proc, string_array argv, const char* cwd)
+{
+    return run_command_ex(proc, argv, cwd, NULL);
+}
+int run_command_ex(const char* proc, string_array argv, const char* cwd, struct rusage* usage)
 {
     pid_t pid = fork();
     if (pid == -1)
@@ -25,18 +34,28 @@ int run_command(const char* proc, string_array argv)
     }
     else if (pid == 0)
     {
+        // Only the child changes directories, as build-all runs commands from several threads at once.
+        if (cwd && chdir(cwd) == -1)
+        {
+            perror("chdir");
+            _exit(EXIT_FAILURE);
+        }
         string_array_append(&argv, NULL);
         execvp(proc, argv.buf);
         perror("execv");
-        exit(EXIT_FAILURE);
+        // The child must not run the parent's atexit handlers (see state_db_close).
+        _exit(EXIT_FAILURE);
     }
 
     int status = 0;
-    if (waitpid(pid, &status, 0) == -1)
+    struct rusage child_usage = {};
+    if (wait4(pid, &status, 0, &child_usage) == -1)
     {
-        perror("waitpid");
+        perror("wait4");
         exit(EXIT_FAILURE);
     }
+    if (usage)
+        *usage = child_usage;
 
     return WEXITSTATUS(status);
 }
@@ -58,7 +77,7 @@ int run_command_supress_output(const char* proc, string_array argv)
         string_array_append(&argv, NULL);
         execvp(proc, argv.buf);
         perror("execv");
-        exit(EXIT_FAILURE);
+        _exit(EXIT_FAILURE);
     }
 
     int status = 0;
@@ -0,0 +1,202 @@
+/*
+ * src/graph.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "graph.h"
+#include "package.h"
+#include "recipe_cache.h"
+#include "path.h"
+
+// Returns PKG_ID_INVALID (after reporting why) if the dependency cannot be satisfied.
+static pkg_id resolve_edge(const package_graph* g, pkg_id id, const char* depend_expr)
+{
+    const char* name = package_graph_name(g, id);
+    char* depend = NULL;
+    union package_version depend_version = {};
+    int version_cmp = 0;
+    parse_depend_expr(depend_expr, &depend, &depend_version, &version_cmp);
+    if (!depend)
+    {
+        printf("%s: While satisfying dependencies for package %s: Invalid expression '%s'. Dropping package.\n", g_argv[0], name, depend_expr);
+        return PKG_ID_INVALID;
+    }
+    pkg_id dep = package_graph_find(g, depend);
+    if (depend != depend_expr)
+        free(depend);
+    if (dep == PKG_ID_INVALID)
+    {
+        printf("%s: While satisfying dependencies for package %s: Invalid or unknown package '%s'. Dropping package.\n", g_argv[0], name, depend_expr);
+        return PKG_ID_INVALID;
+    }
+    const recipe_index_entry* ent = &g->index->entries[dep];
+    if (!do_version_cmp(version_cmp, ent->version, depend_version))
+    {
+        printf("%s: While satisfying dependencies for package %s: Could not satisfy dependency. Requires: %s, got: %s=%d.%d.%d. Dropping package.\n",
+            g_argv[0], name,
+            depend_expr,
+            ent->name,
+            ent->version.major, ent->version.minor, ent->version.patch
+        );
+        return PKG_ID_INVALID;
+    }
+    return dep;
+}
+
+// Resolves the edges of id into out (which must have room for every dependency of id).
+// Returns the amount of edges, and marks id as broken if any of them could not be resolved.
+static size_t resolve_edges(package_graph* g, pkg_id id, pkg_id* out)
+{
+    const recipe_index_entry* ent = &g->index->entries[id];
+    const string_array* lists[2] = { &ent->build_depends, &ent->depends };
+    size_t cnt = 0;
+    for (int l = 0; l < 2; l++)
+    {
+        for (size_t i = 0; i < lists[l]->cnt; i++)
+        {
+            pkg_id dep = resolve_edge(g, id, lists[l]->buf[i]);
+            if (dep == PKG_ID_INVALID)
+            {
+                bitset_set(g->broken, id);
+                continue;
+            }
+            out[cnt++] = dep;
+        }
+    }
+    return cnt;
+}
+
+void package_graph_init(package_graph* g, const recipe_index* index)
+{
+    memset(g, 0, sizeof(*g));
+    g->index = index;
+    g->cnt = index->cnt;
+    g->broken = bitset_alloc(g->cnt);
+
+    // Forward edges.
+    size_t max_edges = 0;
+    for (size_t i = 0; i < g->cnt; i++)
+        max_edges += index->entries[i].depends.cnt + index->entries[i].build_depends.cnt;
+    g->dep_offsets = malloc((g->cnt+1)*sizeof(uint32_t));
+    g->deps = malloc((max_edges ? max_edges : 1)*sizeof(pkg_id));
+    size_t nEdges = 0;
+    for (size_t i = 0; i < g->cnt; i++)
+    {
+        g->dep_offsets[i] = nEdges;
+        nEdges += resolve_edges(g, i, &g->deps[nEdges]);
+    }
+    g->dep_offsets[g->cnt] = nEdges;
+
+    // Reverse edges.
+    g->rdep_offsets = calloc(g->cnt+1, sizeof(uint32_t));
+    g->rdeps = malloc((nEdges ? nEdges : 1)*sizeof(pkg_id));
+    for (size_t e = 0; e < nEdges; e++)
+        g->rdep_offsets[g->deps[e]+1]++;
+    for (size_t i = 0; i < g->cnt; i++)
+        g->rdep_offsets[i+1] += g->rdep_offsets[i];
+    uint32_t* fill = malloc((g->cnt ? g->cnt : 1)*sizeof(uint32_t));
+    memcpy(fill, g->rdep_offsets, g->cnt*sizeof(uint32_t));
+    for (size_t i = 0; i < g->cnt; i++)
+        for (uint32_t e = g->dep_offsets[i]; e < g->dep_offsets[i+1]; e++)
+            g->rdeps[fill[g->deps[e]]++] = i;
+    free(fill);
+
+    // Topological order (Kahn's algorithm).
+    // Whatever is left over is in, or depends on, a dependency cycle.
+    uint32_t* missing = malloc((g->cnt ? g->cnt : 1)*sizeof(uint32_t));
+    g->topo = malloc((g->cnt ? g->cnt : 1)*sizeof(pkg_id));
+    g->nTopo = 0;
+    for (size_t i = 0; i < g->cnt; i++)
+    {
+        missing[i] = g->dep_offsets[i+1] - g->dep_offsets[i];
+        if (!missing[i])
+            g->topo[g->nTopo++] = i;
+    }
+    for (size_t head = 0; head < g->nTopo; head++)
+    {
+        pkg_id id = g->topo[head];
+        for (uint32_t e = g->rdep_offsets[id]; e < g->rdep_offsets[id+1]; e++)
+            if (!(--missing[g->rdeps[e]]))
+                g->topo[g->nTopo++] = g->rdeps[e];
+    }
+    for (size_t i = 0; i < g->cnt; i++)
+    {
+        if (!missing[i])
+            continue;
+        printf("%s: Package %s is part of, or depends on, a recursive dependency. Dropping package.\n", g_argv[0], package_graph_name(g, i));
+        bitset_set(g->broken, i);
+    }
+    free(missing);
+
+    package_graph_reverse_closure(g, g->broken);
+}
+
+void package_graph_free(package_graph* g)
+{
+    free(g->dep_offsets);
+    free(g->deps);
+    free(g->rdep_offsets);
+    free(g->rdeps);
+    free(g->topo);
+    free(g->broken);
+    memset(g, 0, sizeof(*g));
+}
+
+static int cmp_name_entry(const void* key, const void* ent)
+{
+    return strcmp(key, ((const recipe_index_entry*)ent)->name);
+}
+
+pkg_id package_graph_find(const package_graph* g, const char* name)
+{
+    if (!g->cnt)
+        return PKG_ID_INVALID;
+    const recipe_index_entry* ent = bsearch(name, g->index->entries, g->cnt, sizeof(recipe_index_entry), cmp_name_entry);
+    return ent ? (pkg_id)(ent - g->index->entries) : PKG_ID_INVALID;
+}
+
+// Both closures are a single sweep over the topological order.
+
+void package_graph_closure(const package_graph* g, uint64_t* set)
+{
+    for (size_t i = g->nTopo; i > 0; i--)
+    {
+        pkg_id id = g->topo[i-1];
+        if (!bitset_test(set, id))
+            continue;
+        for (uint32_t e = g->dep_offsets[id]; e < g->dep_offsets[id+1]; e++)
+            bitset_set(set, g->deps[e]);
+    }
+}
+
+void package_graph_reverse_closure(const package_graph* g, uint64_t* set)
+{
+    for (size_t i = 0; i < g->nTopo; i++)
+    {
+        pkg_id id = g->topo[i];
+        if (bitset_test(set, id))
+            continue;
+        for (uint32_t e = g->dep_offsets[id]; e < g->dep_offsets[id+1]; e++)
+        {
+            if (bitset_test(set, g->deps[e]))
+            {
+                bitset_set(set, id);
+                break;
+            }
+        }
+    }
+}
+
+void package_graph_mark_broken(package_graph* g, pkg_id id)
+{
+    bitset_set(g->broken, id);
+    package_graph_reverse_closure(g, g->broken);
+}
@@ -0,0 +1,77 @@
+/*
+ * src/graph.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "recipe_cache.h"
+
+// The dependency graph of every recipe in the recipe index.
+// Packages are referred to by dense ids (their position in the index, so ids
+// are sorted by name), and edges are stored in compressed sparse row form:
+// the dependencies of package i are deps[dep_offsets[i]..dep_offsets[i+1]),
+// and its dependants are rdeps[rdep_offsets[i]..rdep_offsets[i+1]).
+// Both depends and build-depends are edges.
+
+typedef uint32_t pkg_id;
+#define PKG_ID_INVALID UINT32_MAX
+
+typedef struct package_graph {
+    const recipe_index* index;
+    size_t cnt;
+    uint32_t* dep_offsets;
+    pkg_id* deps;
+    uint32_t* rdep_offsets;
+    pkg_id* rdeps;
+    // Every package that is not part of, or does not depend on, a dependency cycle, with
+    // dependencies before their dependants.
+    // This includes packages that are broken for any other reason, so callers must test broken.
+    pkg_id* topo;
+    size_t nTopo;
+    // Packages that cannot be built, as they have an unknown, unsatisfiable,
+    // or recursive dependency, or depend on such a package.
+    uint64_t* broken;
+} package_graph;
+
+// Sets of packages, indexed by pkg_id.
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+static inline uint64_t* bitset_alloc(size_t n)
+{
+    return calloc(BITSET_WORDS(n) ? BITSET_WORDS(n) : 1, sizeof(uint64_t));
+}
+static inline void bitset_set(uint64_t* set, size_t i)
+{
+    set[i / 64] |= (uint64_t)1 << (i % 64);
+}
+static inline void bitset_clear(uint64_t* set, size_t i)
+{
+    set[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+static inline bool bitset_test(const uint64_t* set, size_t i)
+{
+    return set[i / 64] & ((uint64_t)1 << (i % 64));
+}
+
+// Reports the reason every broken package is broken.
+void package_graph_init(package_graph* g, const recipe_index* index);
+void package_graph_free(package_graph* g);
+// Returns PKG_ID_INVALID if there is no such package.
+pkg_id package_graph_find(const package_graph* g, const char* name);
+static inline const char* package_graph_name(const package_graph* g, pkg_id id)
+{
+    return g->index->entries[id].name;
+}
+
+// Adds every package that a package in set (transitively) depends on to set.
+void package_graph_closure(const package_graph* g, uint64_t* set);
+// Adds every package that (transitively) depends on a package in set to set.
+void package_graph_reverse_closure(const package_graph* g, uint64_t* set);
+// Marks id, and everything that depends on it, as broken.
+void package_graph_mark_broken(package_graph* g, pkg_id id);
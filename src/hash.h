@@ -0,0 +1,41 @@
+/*
+ * src/hash.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// 64-bit FNV-1a.
+#define HASH_INITIAL 0xcbf29ce484222325ULL
+
+static inline uint64_t hash_buffer_ex(uint64_t hash, const void* buf, size_t len)
+{
+    const uint8_t* iter = buf;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= iter[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+static inline uint64_t hash_buffer(const void* buf, size_t len)
+{
+    return hash_buffer_ex(HASH_INITIAL, buf, len);
+}
+// NOTE: Hashes the NUL terminator too, so that ("ab", "c") and ("a", "bc") hash differently.
+// A NULL string hashes differently from an empty string.
+static inline uint64_t hash_string(uint64_t hash, const char* str)
+{
+    if (!str)
+        return hash_buffer_ex(hash, "\xff", 1);
+    return hash_buffer_ex(hash, str, strlen(str)+1);
+}
+static inline uint64_t hash_u64(uint64_t hash, uint64_t val)
+{
+    return hash_buffer_ex(hash, &val, sizeof(val));
+}
@@ -0,0 +1,82 @@
+/*
+ * src/jobserver.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "jobserver.h"
+
+// The read and write ends of the token pipe.
+// These are inherited by every child process, as make expects.
+static int jobserver_fds[2] = {-1,-1};
+
+void jobserver_init()
+{
+    if (jobserver_fds[0] != -1)
+        return;
+    if (pipe(jobserver_fds) == -1)
+    {
+        perror("pipe");
+        jobserver_fds[0] = jobserver_fds[1] = -1;
+        return;
+    }
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nproc < 1)
+        nproc = 1;
+    for (long i = 0; i < nproc; i++)
+    {
+        if (write(jobserver_fds[1], "+", 1) != 1)
+        {
+            perror("write");
+            break;
+        }
+    }
+
+    // -j without a count tells make to take its jobs from the jobserver.
+    // --jobserver-fds is understood by make versions older than 4.2.
+    const char* old_flags = getenv("MAKEFLAGS");
+    const char* fmt = "%s%s-j --jobserver-auth=%d,%d --jobserver-fds=%d,%d";
+    const char* sep = old_flags && *old_flags ? " " : "";
+    old_flags = old_flags ? old_flags : "";
+    size_t len = snprintf(NULL, 0, fmt, old_flags, sep, jobserver_fds[0], jobserver_fds[1], jobserver_fds[0], jobserver_fds[1]);
+    char* flags = malloc(len+1);
+    snprintf(flags, len+1, fmt, old_flags, sep, jobserver_fds[0], jobserver_fds[1], jobserver_fds[0], jobserver_fds[1]);
+    setenv("MAKEFLAGS", flags, 1);
+    free(flags);
+}
+
+bool jobserver_active()
+{
+    return jobserver_fds[0] != -1;
+}
+
+void jobserver_acquire()
+{
+    if (!jobserver_active())
+        return;
+    char token = 0;
+    ssize_t res = 0;
+    while ((res = read(jobserver_fds[0], &token, 1)) == -1 && errno == EINTR)
+        ;
+    if (res != 1)
+        perror("read");
+}
+
+void jobserver_release()
+{
+    if (!jobserver_active())
+        return;
+    if (write(jobserver_fds[1], "+", 1) != 1)
+        perror("write");
+}
@@ -0,0 +1,26 @@
+/*
+ * src/jobserver.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+// obos-strap owns a GNU make jobserver, a pipe holding one token per CPU, which is passed
+// to every process it starts through MAKEFLAGS.
+// Every package being built holds a token (see jobserver_acquire), which is the implicit
+// job slot of the commands building it. Any further job takes a token from the same pool,
+// so the amount of jobs stays at the CPU count, no matter how many packages are built at once.
+
+// Creates the jobserver, and exports it through MAKEFLAGS.
+// Must be called before any other thread runs commands. Does nothing if it was already called.
+void jobserver_init();
+// Returns true if the jobserver was created.
+bool jobserver_active();
+// Blocks until a token is free, and takes it.
+// Does nothing if there is no jobserver.
+void jobserver_acquire();
+// Gives back a token taken with jobserver_acquire.
+void jobserver_release();
@@ -0,0 +1,344 @@
+/*
+ * src/json_stream.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "json_stream.h"
+
+static void skip_whitespace(json_stream* s)
+{
+    while (s->iter < s->end && (*s->iter == ' ' || *s->iter == '\t' || *s->iter == '\n' || *s->iter == '\r'))
+        s->iter++;
+}
+
+static bool consume(json_stream* s, char c)
+{
+    skip_whitespace(s);
+    if (s->error || s->iter >= s->end || *s->iter != c)
+    {
+        s->error = true;
+        return false;
+    }
+    s->iter++;
+    return true;
+}
+
+static bool consume_literal(json_stream* s, const char* lit)
+{
+    size_t len = strlen(lit);
+    if ((size_t)(s->end - s->iter) < len || memcmp(s->iter, lit, len) != 0)
+    {
+        s->error = true;
+        return false;
+    }
+    s->iter += len;
+    return true;
+}
+
+int json_peek(json_stream* s)
+{
+    skip_whitespace(s);
+    if (s->error || s->iter >= s->end)
+        return JSON_TYPE_INVALID;
+    switch (*s->iter)
+    {
+        case '"': return JSON_TYPE_STRING;
+        case '{': return JSON_TYPE_OBJECT;
+        case '[': return JSON_TYPE_ARRAY;
+        case 't': return JSON_TYPE_TRUE;
+        case 'f': return JSON_TYPE_FALSE;
+        case 'n': return JSON_TYPE_NULL;
+        case '-':
+        case '0' ... '9':
+            return JSON_TYPE_NUMBER;
+        default: return JSON_TYPE_INVALID;
+    }
+}
+
+static int hex_digit(char c)
+{
+    switch (c)
+    {
+        case '0' ... '9': return c - '0';
+        case 'a' ... 'f': return c - 'a' + 10;
+        case 'A' ... 'F': return c - 'A' + 10;
+        default: return -1;
+    }
+}
+
+static bool parse_hex4(json_stream* s, uint32_t* out)
+{
+    if (s->end - s->iter < 4)
+        return false;
+    uint32_t val = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int digit = hex_digit(s->iter[i]);
+        if (digit == -1)
+            return false;
+        val = (val << 4) | digit;
+    }
+    s->iter += 4;
+    *out = val;
+    return true;
+}
+
+static char* encode_utf8(char* out, uint32_t cp)
+{
+    if (cp < 0x80)
+        *out++ = cp;
+    else if (cp < 0x800)
+    {
+        *out++ = 0xc0 | (cp >> 6);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    else if (cp < 0x10000)
+    {
+        *out++ = 0xe0 | (cp >> 12);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    else
+    {
+        *out++ = 0xf0 | (cp >> 18);
+        *out++ = 0x80 | ((cp >> 12) & 0x3f);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    return out;
+}
+
+char* json_string(json_stream* s)
+{
+    if (json_peek(s) != JSON_TYPE_STRING)
+    {
+        s->error = true;
+        return NULL;
+    }
+    char* start = ++s->iter;
+    char* out = start;
+    while (s->iter < s->end && *s->iter != '"')
+    {
+        char c = *s->iter++;
+        if (c != '\\')
+        {
+            *out++ = c;
+            continue;
+        }
+        if (s->iter >= s->end)
+            break;
+        c = *s->iter++;
+        switch (c)
+        {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u':
+            {
+                uint32_t cp = 0;
+                if (!parse_hex4(s, &cp))
+                {
+                    s->error = true;
+                    return NULL;
+                }
+                // Surrogate pair.
+                if (cp >= 0xd800 && cp <= 0xdbff && (s->end - s->iter) >= 6 && s->iter[0] == '\\' && s->iter[1] == 'u')
+                {
+                    s->iter += 2;
+                    uint32_t low = 0;
+                    if (!parse_hex4(s, &low) || low < 0xdc00 || low > 0xdfff)
+                    {
+                        s->error = true;
+                        return NULL;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                out = encode_utf8(out, cp);
+                break;
+            }
+            default:
+                s->error = true;
+                return NULL;
+        }
+    }
+    if (s->iter >= s->end)
+    {
+        s->error = true;
+        return NULL;
+    }
+    // Skip the closing quote.
+    s->iter++;
+    *out = 0;
+    return start;
+}
+
+// Unlike json_string, does not modify the string.
+static void skip_string(json_stream* s)
+{
+    s->iter++;
+    while (s->iter < s->end && *s->iter != '"')
+    {
+        if (*s->iter == '\\')
+            s->iter++;
+        s->iter++;
+    }
+    if (s->iter >= s->end)
+    {
+        s->error = true;
+        return;
+    }
+    s->iter++;
+}
+
+bool json_number(json_stream* s, double* out)
+{
+    if (json_peek(s) != JSON_TYPE_NUMBER)
+    {
+        s->error = true;
+        return false;
+    }
+    // Copied, as the input is not NUL-terminated.
+    char buf[64];
+    size_t len = 0;
+    while (s->iter + len < s->end && len < sizeof(buf)-1 && strchr("+-.eE0123456789", s->iter[len]))
+        len++;
+    memcpy(buf, s->iter, len);
+    buf[len] = 0;
+    char* end = NULL;
+    *out = strtod(buf, &end);
+    if (end == buf)
+    {
+        s->error = true;
+        return false;
+    }
+    s->iter += end - buf;
+    return true;
+}
+
+bool json_object_begin(json_stream* s)
+{
+    return consume(s, '{');
+}
+
+bool json_object_next(json_stream* s, bool* first, char** key)
+{
+    skip_whitespace(s);
+    if (s->error || s->iter >= s->end)
+    {
+        s->error = true;
+        return false;
+    }
+    if (*s->iter == '}')
+    {
+        s->iter++;
+        return false;
+    }
+    if (!*first && !consume(s, ','))
+        return false;
+    *first = false;
+    *key = json_string(s);
+    if (!*key)
+        return false;
+    return consume(s, ':');
+}
+
+bool json_array_begin(json_stream* s)
+{
+    return consume(s, '[');
+}
+
+bool json_array_next(json_stream* s, bool* first)
+{
+    skip_whitespace(s);
+    if (s->error || s->iter >= s->end)
+    {
+        s->error = true;
+        return false;
+    }
+    if (*s->iter == ']')
+    {
+        s->iter++;
+        return false;
+    }
+    if (!*first && !consume(s, ','))
+        return false;
+    *first = false;
+    return true;
+}
+
+void json_skip(json_stream* s)
+{
+    switch (json_peek(s))
+    {
+        case JSON_TYPE_STRING:
+            skip_string(s);
+            break;
+        case JSON_TYPE_NUMBER:
+        {
+            double unused = 0;
+            json_number(s, &unused);
+            break;
+        }
+        case JSON_TYPE_OBJECT:
+        {
+            // Keys are skipped by hand, as json_object_next would decode them.
+            if (!consume(s, '{'))
+                break;
+            bool first = true;
+            while (!s->error)
+            {
+                skip_whitespace(s);
+                if (s->iter < s->end && *s->iter == '}')
+                {
+                    s->iter++;
+                    break;
+                }
+                if (!first && !consume(s, ','))
+                    break;
+                first = false;
+                if (json_peek(s) != JSON_TYPE_STRING)
+                {
+                    s->error = true;
+                    break;
+                }
+                skip_string(s);
+                if (!consume(s, ':'))
+                    break;
+                json_skip(s);
+            }
+            break;
+        }
+        case JSON_TYPE_ARRAY:
+        {
+            bool first = true;
+            if (json_array_begin(s))
+                while (json_array_next(s, &first))
+                    json_skip(s);
+            break;
+        }
+        case JSON_TYPE_TRUE:
+            consume_literal(s, "true");
+            break;
+        case JSON_TYPE_FALSE:
+            consume_literal(s, "false");
+            break;
+        case JSON_TYPE_NULL:
+            consume_literal(s, "null");
+            break;
+        default:
+            s->error = true;
+            break;
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * src/json_stream.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A pull parser for JSON, that never builds a tree.
+// Strings are decoded in-place, and NUL-terminated in the input buffer
+// (the decoded string is never longer than its encoded form), so the
+// buffer must be writable, and strings returned point into it.
+
+enum {
+    JSON_TYPE_INVALID,
+    JSON_TYPE_STRING,
+    JSON_TYPE_NUMBER,
+    JSON_TYPE_OBJECT,
+    JSON_TYPE_ARRAY,
+    JSON_TYPE_TRUE,
+    JSON_TYPE_FALSE,
+    JSON_TYPE_NULL,
+};
+
+typedef struct json_stream {
+    char* iter;
+    char* end;
+    // Set on any syntax error, after which every function fails.
+    bool error;
+} json_stream;
+
+// Returns the type of the next value, without consuming it.
+int json_peek(json_stream* s);
+// Consumes the next value, whatever it is.
+// Does not modify the buffer, so the value can be parsed later on from where it started.
+void json_skip(json_stream* s);
+// Returns NULL if the next value is not a string.
+char* json_string(json_stream* s);
+bool json_number(json_stream* s, double* out);
+
+// Iterating over an object:
+// bool first = true;
+// char* key = NULL;
+// if (json_object_begin(s))
+//     while (json_object_next(s, &first, &key))
+//         /* consume the value */
+// Arrays work the same, without a key.
+bool json_object_begin(json_stream* s);
+bool json_object_next(json_stream* s, bool* first, char** key);
+bool json_array_begin(json_stream* s);
+bool json_array_next(json_stream* s, bool* first);
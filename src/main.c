@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +25,10 @@
 #include "package.h"
 #include "path.h"
 #include "update.h"
+#include "outdated.h"
+#include "recipe_cache.h"
+#include "hash.h"
+#include "state_db.h"
 
 #if HAS_LIBCURL
 #   include <curl/curl.h>
@@ -51,6 +56,7 @@ const char* bootstrap_directory = "./bootstrap";
 const char* repo_directory = "./repos";
 const char* recipes_directory = "./recipes";
 const char* pkg_info_directory = "./pkginfo";
+const char* recipe_cache_directory = "./recipe_cache";
 
 void clean();
 void build_pkg(const char* pkg);
@@ -58,13 +64,13 @@ void rebuild_pkg(const char* pkg);
 void install_pkg(const char* pkg);
 void build_binary_package(const char* name);
 void run_pkg(const char* pkg);
-void buildall();
+bool buildall(const char* trace_path, bool keep_going);
 
 int g_argc = 0;
 char** g_argv = 0;
 
 const char* help =
-"build, clean, build-all/install-all, rebuild, setup-env, force-unlock, install, chroot, run, list, update, install-bin-pkg, outdated, start-proc\n";
+"build, clean, build-all/install-all, rebuild, setup-env, force-unlock, install, chroot, run, list, update, install-bin-pkg, outdated, start-proc, complete\n";
 
 const char* version =
 "obos-strap v0.0.1\n"
@@ -106,11 +112,42 @@ struct list_cb_user {
     bool verbose : 1;
     bool installed_only : 1;
 };
-int list_cb(package* pkg, struct pkginfo* info, void* userdata)
+// Prints what each stage of the package used the last time it was run.
+static void print_stage_usage(const struct pkginfo* info)
+{
+    static char const* const stage_strs[] = {
+        "fetch",
+        "configure",
+        "build",
+        "install",
+    };
+    for (int i = 0; i < BUILD_STATE_INSTALLED && i < info->build_state; i++)
+    {
+        if (!info->stage_durations[i])
+            continue;
+        // Stages that ran no processes, or that were run before their usage was recorded.
+        if (!info->stage_user_time[i] && !info->stage_system_time[i] && !info->stage_max_rss[i])
+        {
+            printf("    %-9s %8.2fs wall\n", stage_strs[i], info->stage_durations[i] / 1000000.0);
+            continue;
+        }
+        printf("    %-9s %8.2fs wall %8.2fs user %8.2fs system %8" PRIu64 " KiB max RSS %8" PRIu32 " blocks in %8" PRIu32 " blocks out\n",
+            stage_strs[i],
+            info->stage_durations[i] / 1000000.0,
+            info->stage_user_time[i] / 1000000.0,
+            info->stage_system_time[i] / 1000000.0,
+            info->stage_max_rss[i],
+            info->stage_blocks_in[i],
+            info->stage_blocks_out[i]
+        );
+    }
+}
+
+int list_cb(const char* name, union package_version version, bool host_package, struct pkginfo* info, void* userdata)
 {
     struct list_cb_user* opt = userdata;
     if (!opt->verbose)
-        printf("%s\n", pkg->name);
+        printf("%s\n", name);
     else if (info)
     {
         static char const* const build_state_strs[] = {
@@ -149,7 +186,7 @@ int list_cb(package* pkg, struct pkginfo* info, void* userdata)
         if (tm_info)
         {
             printf("%s@%d.%d.%d-%.*s BUILD_STATE_%s since %s, %s %02d, %d at %02d:%02d:%02d\n",
-                pkg->name,
+                name,
                 info->version.major, info->version.minor,
                 info->version.patch,
                 (int)info->host_triplet_len, info->host_triplet,
@@ -166,7 +203,7 @@ int list_cb(package* pkg, struct pkginfo* info, void* userdata)
         else
         {
             printf("%s@%d.%d.%d-%.*s BUILD_STATE_%s\n",
-                pkg->name,
+                name,
                 info->version.major, info->version.minor,
                 info->version.patch,
                 (int)info->host_triplet_len, info->host_triplet,
@@ -175,21 +212,20 @@ int list_cb(package* pkg, struct pkginfo* info, void* userdata)
                     "INVALID"
             );
         }
+        print_stage_usage(info);
     }
     else
         printf("%s@%d.%d.%d-%s BUILD_STATE_CLEAN\n", 
-            pkg->name, 
-            pkg->version.major, pkg->version.minor, pkg->version.patch,
-            pkg->host_package || !g_config.cross_compiling ? g_config.host_triplet : g_config.target_triplet
+            name, 
+            version.major, version.minor, version.patch,
+            host_package || !g_config.cross_compiling ? g_config.host_triplet : g_config.target_triplet
         );
     free(info);
-    free(pkg);
     return 0;
 }
 
-int main(int argc, char **argv)
+static int run(int argc, char **argv)
 {
-    argv[0] = basename(argv[0]);
     if (argc < 2)
     {
         printf("%s: %s", argv[0], help);
@@ -271,6 +307,15 @@ int main(int argc, char **argv)
                 }
         }
 
+        if (stat(recipe_cache_directory, &tmp) == -1)
+        {
+            if (mkdir(recipe_cache_directory, st.st_mode | 0200) == -1)
+            {
+                perror("mkdir");
+                return -1;
+            }
+        }
+
         if (stat(bootstrap_directory, &tmp) == -1)
         {
             if (mkdir(bootstrap_directory, st.st_mode | 0200) == -1)
@@ -311,11 +356,12 @@ int main(int argc, char **argv)
     fstat(fileno(pkg_json), &st);
 
     char* json_data = malloc(st.st_size);
-    fread(json_data, st.st_size, 1, pkg_json);
+    size_t nRead = fread(json_data, 1, st.st_size, pkg_json);
 
     fclose(pkg_json);
 
-    cJSON* context = cJSON_Parse(json_data);
+    // NOTE: json_data is not NUL-terminated.
+    cJSON* context = cJSON_ParseWithLength(json_data, nRead);
     if (!context)
     {
         printf("%s: Parsing settings.json failed.\n", g_argv[0]);
@@ -347,6 +393,11 @@ int main(int argc, char **argv)
         printf("FATAL: Recipes directory does not exist.\n");
         return -1;
     }
+    // The recipe cache is optional, and is created on demand
+    // for environments set up by older versions of obos-strap.
+    if (mkdir(recipe_cache_directory, 0755) == -1 && errno != EEXIST)
+        perror("Warning: Could not create recipe cache directory");
+    recipe_cache_directory = realpath(recipe_cache_directory, NULL);
     if (!pkg_info_directory || !destination_directory || !bootstrap_directory || !repo_directory || !host_prefix_directory || !binary_package_directory)
     {
         printf("One or more required directories are missing. Did you forget to run %s setup-env after cleaning?\n", g_argv[0]);
@@ -372,6 +423,7 @@ int main(int argc, char **argv)
     } while(0);
 
 extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, package* pkg);
+    g_config.environment_hash = HASH_INITIAL;
     do {
         cJSON* child = cJSON_GetObjectItem(context, "environment");
         if (!child)
@@ -386,15 +438,19 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
                 fprintf(stderr, "Invalid environment object in settings.json\n");
                 continue;
             }
+            cJSON* replace_obj = cJSON_GetObjectItem(i, "replace");
+            bool replace = true;
+            if (replace_obj && cJSON_IsBool(replace_obj))
+                replace = cJSON_IsTrue(replace_obj);
+            // Part of every package's fingerprint, as commands can refer to these.
+            g_config.environment_hash = hash_string(g_config.environment_hash, env);
+            g_config.environment_hash = hash_string(g_config.environment_hash, val);
+            g_config.environment_hash = hash_u64(g_config.environment_hash, replace);
             if (!val)
             {
                 unsetenv(env);
                 continue;
             }
-            cJSON* replace_obj = cJSON_GetObjectItem(i, "replace");
-            bool replace = true;
-            if (replace_obj && cJSON_IsBool(replace_obj))
-                replace = cJSON_IsTrue(replace_obj);
             if (setenv(env, val, replace) == -1)
                 perror("Warning: Could not setenv");            
         }
@@ -458,10 +514,10 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
     {
         if (argc < 3)
         {
-            printf("%s outdated pkg\n", argv[0]);
+            printf("%s outdated pkg... | all\n", argv[0]);
             return -1;
         }
-        return !package_outdated(get_package(argv[2]), NULL, BUILD_STATE_INSTALLED);    
+        return outdated((const char* const*)argv + 2, argc - 2);
     }
     else if (strcmp(argv[1], "update") == 0)
         update();
@@ -476,6 +532,22 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
     }
     else if (strcmp(argv[1], "build-all") == 0 || strcmp(argv[1], "install-all") == 0)
     {
+        const char* trace_path = NULL;
+        bool keep_going = false;
+        for (int i = 2; i < argc; i++)
+        {
+            if (strncmp(argv[i], "trace=", 6) == 0 && argv[i][6])
+                trace_path = argv[i] + 6;
+            else if (strcmp(argv[i], "keep-going") == 0 || strcasecmp(argv[i], "keep-going=true") == 0)
+                keep_going = true;
+            else if (strcasecmp(argv[i], "keep-going=false") == 0)
+                keep_going = false;
+            else
+            {
+                printf("%s %s [keep-going[=true|false]] [trace=file]\n", argv[0], argv[1]);
+                return -1;
+            }
+        }
         printf("%s: Installing all packages. This can take a long time.\nContinue? y/n ", argv[0]);
         char c = 0;
         do {
@@ -488,7 +560,8 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
                 default: fputs("Please put y/n ", stdout); break;
             }
         } while(c != 'y');
-        buildall();
+        if (!buildall(trace_path, keep_going))
+            return 1;
     }
     else if (strcmp(argv[1], "clean") == 0)
     {
@@ -575,7 +648,21 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
                 free((char*)opt_key);
         }
         if (!opts.nPackages)
-            foreach_package(opts.installed_only, list_cb, &opts);
+        {
+            // Answered from the recipe index, so that we do not have to load every recipe.
+            const recipe_index* index = get_recipe_index();
+            for (size_t i = 0; i < index->cnt; i++)
+            {
+                const recipe_index_entry* ent = &index->entries[i];
+                struct pkginfo* info = NULL;
+                if (opts.verbose || opts.installed_only)
+                    info = read_package_info_ex(ent->name, false, false);
+                if (!info && opts.installed_only)
+                    continue;
+                if (list_cb(ent->name, ent->version, ent->host_package, info, &opts) != 0)
+                    break;
+            }
+        }
         else
         {
             for (size_t i = 0; i < opts.nPackages; i++)
@@ -588,11 +675,8 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
                 }
                 struct pkginfo* info = read_package_info_ex(pkg->name, false, false);
                 if (!info && opts.installed_only)
-                {
-                    free(pkg);
                     continue;
-                }
-                if (list_cb(pkg, info, &opts) != 0)
+                if (list_cb(pkg->name, pkg->version, pkg->host_package, info, &opts) != 0)
                     break;
             }
         }
@@ -618,6 +702,13 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
         } while(c != 'y');
         rebuild_pkg(argv[2]);
     }
+    else if (strcmp(argv[1], "complete") == 0)
+    {
+        // Machine-readable list of packages, for shell completion.
+        const recipe_index* index = get_recipe_index();
+        for (size_t i = 0; i < index->cnt; i++)
+            printf("%s\n", index->entries[i].name);
+    }
     else if (strcmp(argv[1], "force-unlock") == 0)
     {
         unlock_forced();
@@ -657,3 +748,13 @@ extern const char* get_str_field_subst(cJSON* parent, const char* fieldname, pac
 
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    argv[0] = basename(argv[0]);
+    int ec = run(argc, argv);
+    // Not done with atexit, as the children of run_command_ex would run it if they failed to start.
+    // If this is skipped (e.g., by exit), the log is applied the next time the database is opened.
+    state_db_close();
+    return ec;
+}
@@ -0,0 +1,269 @@
+/*
+ * src/manifest.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "manifest.h"
+#include "package.h"
+#include "path.h"
+#include "hash.h"
+
+typedef struct manifest_entry {
+    char* path;
+    uint64_t hash;
+} manifest_entry;
+
+typedef struct manifest {
+    manifest_entry* buf;
+    size_t cnt;
+    size_t cap;
+    // Entries changed before this are not part of the manifest.
+    // NULL if every entry is.
+    const struct timespec* since;
+} manifest;
+
+static uint64_t hash_file_contents(int dirfd, const char* name)
+{
+    int fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+    if (fd == -1)
+        return hash_string(HASH_INITIAL, NULL);
+    uint64_t hash = HASH_INITIAL;
+    char buf[65536];
+    ssize_t nRead = 0;
+    while ((nRead = read(fd, buf, sizeof(buf))) > 0)
+        hash = hash_buffer_ex(hash, buf, nRead);
+    close(fd);
+    return hash;
+}
+
+static void manifest_append(manifest* m, char* path, uint64_t hash)
+{
+    if (m->cnt >= m->cap)
+    {
+        m->cap = m->cap ? m->cap*2 : 64;
+        m->buf = realloc(m->buf, m->cap*sizeof(manifest_entry));
+    }
+    m->buf[m->cnt++] = (manifest_entry){.path=path, .hash=hash};
+}
+
+static bool changed_since(const struct stat* st, const struct timespec* since)
+{
+    if (!since)
+        return true;
+    // ctime, as opposed to mtime, cannot be preserved by the install commands (e.g., with cp -p).
+    if (st->st_ctim.tv_sec != since->tv_sec)
+        return st->st_ctim.tv_sec > since->tv_sec;
+    return st->st_ctim.tv_nsec >= since->tv_nsec;
+}
+
+// rel_path is relative to the root of the manifest, and is "" for the root itself.
+static void scan_directory(manifest* m, int dirfd, const char* rel_path)
+{
+    DIR* dir = fdopendir(dirfd);
+    if (!dir)
+    {
+        close(dirfd);
+        return;
+    }
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir)))
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        struct stat st = {};
+        if (fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        size_t len = snprintf(NULL, 0, "%s/%s", rel_path, ent->d_name);
+        char* path = malloc(len+1);
+        snprintf(path, len+1, "%s/%s", rel_path, ent->d_name);
+        if (S_ISDIR(st.st_mode))
+        {
+            int fd = openat(dirfd, ent->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC|O_NOFOLLOW);
+            if (fd != -1)
+                scan_directory(m, fd, path);
+            free(path);
+            continue;
+        }
+        if (!changed_since(&st, m->since))
+        {
+            free(path);
+            continue;
+        }
+        uint64_t hash = hash_u64(HASH_INITIAL, st.st_mode & (S_IFMT|0777));
+        if (S_ISLNK(st.st_mode))
+        {
+            char target[4096];
+            ssize_t target_len = readlinkat(dirfd, ent->d_name, target, sizeof(target));
+            if (target_len > 0)
+                hash = hash_buffer_ex(hash, target, target_len);
+        }
+        else if (S_ISREG(st.st_mode))
+            hash = hash_u64(hash, hash_file_contents(dirfd, ent->d_name));
+        manifest_append(m, path, hash);
+    }
+    closedir(dir);
+}
+
+static int cmp_manifest_entries(const void* lhs, const void* rhs)
+{
+    return strcmp(((const manifest_entry*)lhs)->path, ((const manifest_entry*)rhs)->path);
+}
+
+uint64_t hash_install_output(package* pkg, const struct timespec* install_start)
+{
+    manifest m = {};
+    const char* root = NULL;
+    if (pkg->supports_binary_packages)
+        root = package_make_bin_prefix(pkg);
+    else if (!pkg->host_package)
+        root = package_make_staging_directory(pkg);
+    else
+    {
+        root = host_prefix_directory;
+        m.since = install_start;
+    }
+    int fd = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd != -1)
+        scan_directory(&m, fd, "");
+
+    // m.buf is NULL if nothing was found.
+    if (m.cnt)
+        qsort(m.buf, m.cnt, sizeof(*m.buf), cmp_manifest_entries);
+    uint64_t hash = hash_u64(HASH_INITIAL, m.cnt);
+    for (size_t i = 0; i < m.cnt; i++)
+    {
+        hash = hash_string(hash, m.buf[i].path);
+        hash = hash_u64(hash, m.buf[i].hash);
+        free(m.buf[i].path);
+    }
+    free(m.buf);
+    return hash ? hash : 1;
+}
+
+// Copies a file that cannot be renamed into place, as it is on another file system.
+static bool copy_entry(int src_dirfd, int dst_dirfd, const char* name, const struct stat* st)
+{
+    if (unlinkat(dst_dirfd, name, 0) == -1 && errno != ENOENT)
+        return false;
+    if (S_ISLNK(st->st_mode))
+    {
+        char target[4096];
+        ssize_t target_len = readlinkat(src_dirfd, name, target, sizeof(target)-1);
+        if (target_len == -1)
+            return false;
+        target[target_len] = 0;
+        return symlinkat(target, dst_dirfd, name) == 0;
+    }
+    if (!S_ISREG(st->st_mode))
+        return mknodat(dst_dirfd, name, st->st_mode, st->st_rdev) == 0;
+    int src = openat(src_dirfd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+    if (src == -1)
+        return false;
+    int dst = openat(dst_dirfd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, st->st_mode & 07777);
+    if (dst == -1)
+    {
+        close(src);
+        return false;
+    }
+    bool res = true;
+    char buf[65536];
+    ssize_t nRead = 0;
+    while (res && (nRead = read(src, buf, sizeof(buf))) > 0)
+        res = write(dst, buf, nRead) == nRead;
+    res = res && nRead == 0;
+    if (res)
+    {
+        // The mode is masked by the umask when the file is created.
+        fchmod(dst, st->st_mode & 07777);
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        futimens(dst, times);
+    }
+    close(src);
+    close(dst);
+    return res;
+}
+
+// Moves everything in src_dirfd into dst_dirfd.
+// rel_path is relative to the staging directory, and is "" for the staging directory itself.
+static bool merge_directory(int src_dirfd, int dst_dirfd, const char* rel_path)
+{
+    DIR* dir = fdopendir(src_dirfd);
+    if (!dir)
+    {
+        close(src_dirfd);
+        return false;
+    }
+    bool res = true;
+    struct dirent* ent = NULL;
+    while (res && (ent = readdir(dir)))
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        struct stat st = {};
+        if (fstatat(src_dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        size_t len = snprintf(NULL, 0, "%s/%s", rel_path, ent->d_name);
+        char* path = malloc(len+1);
+        snprintf(path, len+1, "%s/%s", rel_path, ent->d_name);
+        if (S_ISDIR(st.st_mode))
+        {
+            // Directories are merged into existing ones, which can be symlinks to
+            // directories (e.g., lib -> usr/lib), as if the package was installed there directly.
+            if (mkdirat(dst_dirfd, ent->d_name, st.st_mode & 07777) == -1 && errno != EEXIST)
+                res = false;
+            int src_fd = res ? openat(src_dirfd, ent->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC|O_NOFOLLOW) : -1;
+            int dst_fd = res ? openat(dst_dirfd, ent->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC) : -1;
+            if (src_fd == -1 || dst_fd == -1)
+            {
+                if (src_fd != -1)
+                    close(src_fd);
+                res = false;
+            }
+            else
+                res = merge_directory(src_fd, dst_fd, path);
+            if (dst_fd != -1)
+                close(dst_fd);
+        }
+        else if (renameat(src_dirfd, ent->d_name, dst_dirfd, ent->d_name) == -1)
+            res = errno == EXDEV && copy_entry(src_dirfd, dst_dirfd, ent->d_name, &st);
+        if (!res)
+            fprintf(stderr, "%s: Could not install %s: %s\n", g_argv[0], path, strerror(errno));
+        free(path);
+    }
+    closedir(dir);
+    return res;
+}
+
+bool merge_staging_directory(package* pkg)
+{
+    int src_fd = open(package_make_staging_directory(pkg), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    // Nothing was installed.
+    if (src_fd == -1)
+        return true;
+    int dst_fd = open(destination_directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (dst_fd == -1)
+    {
+        perror("open");
+        close(src_fd);
+        return false;
+    }
+    bool res = merge_directory(src_fd, dst_fd, "");
+    close(dst_fd);
+    return res;
+}
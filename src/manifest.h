@@ -0,0 +1,26 @@
+/*
+ * src/manifest.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "package.h"
+
+// The manifest of a package's installed output is the sorted list of files (and symlinks)
+// its install commands wrote, along with the hash of their contents.
+// If the package supports binary packages, that is everything under its binary package prefix.
+// Otherwise, for target packages, it is everything under their staging directory (see
+// package_make_staging_directory), and for host packages, every file under host_prefix_directory
+// that was changed after install_start.
+
+// Returns the hash of the manifest of pkg's output, never zero.
+// Must be called before merge_staging_directory.
+uint64_t hash_install_output(package* pkg, const struct timespec* install_start);
+// Moves everything installed into pkg's staging directory into destination_directory.
+// Returns false on failure.
+bool merge_staging_directory(package* pkg);
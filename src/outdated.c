@@ -0,0 +1,107 @@
+/*
+ * src/outdated.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "outdated.h"
+#include "package.h"
+#include "path.h"
+#include "recipe_cache.h"
+#include "parallel.h"
+
+typedef struct outdated_ctx {
+    const char* const* names;
+    // Indexed like names.
+    int* reasons;
+    int* states;
+    bool* missing;
+} outdated_ctx;
+
+static const char* const reason_strs[] = {
+    [OUTDATED_REASON_NONE] = "none",
+    [OUTDATED_REASON_TRIPLET] = "triplet",
+    [OUTDATED_REASON_STAGE] = "stage",
+    [OUTDATED_REASON_VERSION] = "version",
+    [OUTDATED_REASON_RECIPE] = "recipe",
+    [OUTDATED_REASON_DEPENDENCY] = "dependency",
+};
+
+// Indexed by the build state that the stage results in, minus one.
+static const char* const stage_strs[] = {
+    "fetch",
+    "configure",
+    "build",
+    "install",
+};
+
+static void check_package(size_t i, void* udata)
+{
+    outdated_ctx* ctx = udata;
+    package* pkg = get_package(ctx->names[i]);
+    if (!pkg)
+    {
+        ctx->missing[i] = true;
+        return;
+    }
+    // Unlike read_package_info, this does not create a record for packages that were never built.
+    struct pkginfo* info = read_package_info_ex(pkg->name, false, false);
+    if (!info)
+        ctx->reasons[i] = OUTDATED_REASON_STAGE;
+    else
+        ctx->reasons[i] = package_outdated_reason(pkg, info, BUILD_STATE_INSTALLED, &ctx->states[i]);
+    free(info);
+}
+
+int outdated(const char* const* names, size_t cnt)
+{
+    const char** all_names = NULL;
+    if (cnt == 1 && strcmp(names[0], "all") == 0)
+    {
+        const recipe_index* index = get_recipe_index();
+        all_names = malloc((index->cnt ? index->cnt : 1)*sizeof(const char*));
+        for (size_t i = 0; i < index->cnt; i++)
+            all_names[i] = index->entries[i].name;
+        names = all_names;
+        cnt = index->cnt;
+    }
+
+    outdated_ctx ctx = {
+        .names=names,
+        .reasons=calloc(cnt ? cnt : 1, sizeof(int)),
+        .states=calloc(cnt ? cnt : 1, sizeof(int)),
+        .missing=calloc(cnt ? cnt : 1, sizeof(bool)),
+    };
+    parallel_for(cnt, check_package, &ctx);
+
+    bool any_outdated = false;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (ctx.missing[i])
+        {
+            fprintf(stderr, "%s: Could not find package %s\n", g_argv[0], names[i]);
+            continue;
+        }
+        int reason = ctx.reasons[i];
+        if (!reason)
+            continue;
+        any_outdated = true;
+        if (reason == OUTDATED_REASON_RECIPE || reason == OUTDATED_REASON_DEPENDENCY)
+            printf("%s %s %s\n", names[i], reason_strs[reason], stage_strs[ctx.states[i]]);
+        else
+            printf("%s %s\n", names[i], reason_strs[reason]);
+    }
+
+    free(ctx.reasons);
+    free(ctx.states);
+    free(ctx.missing);
+    free(all_names);
+    return !any_outdated;
+}
@@ -0,0 +1,15 @@
+/*
+ * src/outdated.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// Checks every package in names (or every package, if names is just "all") in parallel,
+// and prints a line for each outdated one: "<name> <reason>", followed by the stage that
+// has to be redone for recipe and dependency changes.
+// Returns zero if any package is outdated, like outdated does for a single package.
+int outdated(const char* const* names, size_t cnt);
@@ -19,26 +19,56 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <ctype.h>
 #include <assert.h>
-#include <dirent.h>
+#include <pthread.h>
+#include <threads.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "package.h"
 #include "path.h"
+#include "tree.h"
+#include "hash.h"
+#include "recipe_cache.h"
+#include "subst.h"
+#include "json_stream.h"
+#include "state_db.h"
+#include "jobserver.h"
 
 #include <cjson/cJSON.h>
 
+// Makes room for one more element, growing the buffer geometrically.
+static void* array_reserve(arena* a, void* buf, size_t cnt, size_t* cap, size_t elem_size)
+{
+    if (cnt < *cap)
+        return buf;
+    size_t new_cap = *cap ? *cap * 2 : 4;
+    if (a)
+        buf = arena_realloc(a, buf, *cap * elem_size, new_cap * elem_size);
+    else
+        buf = realloc(buf, new_cap * elem_size);
+    *cap = new_cap;
+    return buf;
+}
+
+// Appends str without copying it.
+static void string_array_append_view(string_array* arr, char* str)
+{
+    arr->buf = array_reserve(arr->arena, arr->buf, arr->cnt, &arr->cap, sizeof(char*));
+    arr->buf[arr->cnt++] = str;
+}
+
 void string_array_append(string_array* arr, const char* str)
 {
-    arr->buf = realloc(arr->buf,  (arr->cnt+1)*sizeof(command));
     if (!str)
     {
-        arr->buf[arr->cnt++] = NULL;
+        string_array_append_view(arr, NULL);
         return;
     }
     size_t str_len = strlen(str);
-    arr->buf[arr->cnt++] = memcpy(malloc(str_len+1), str, str_len);
-    arr->buf[arr->cnt - 1][str_len] = 0;
+    char* copy = arr->arena ? arena_alloc(arr->arena, str_len+1) : malloc(str_len+1);
+    memcpy(copy, str, str_len+1);
+    string_array_append_view(arr, copy);
 }
 const char* string_array_at(string_array* arr, size_t idx)
 {
@@ -48,6 +78,8 @@ const char* string_array_at(string_array* arr, size_t idx)
 }
 void string_array_free(string_array* arr)
 {
+    if (arr->arena)
+        return;
     for (size_t i = 0; i < arr->cnt; i++)
         free(arr->buf[i]);
     free(arr->buf);
@@ -55,7 +87,7 @@ void string_array_free(string_array* arr)
 
 void command_array_append(command_array* arr, command* cmd)
 {
-    arr->buf = realloc(arr->buf, (arr->cnt+1)*sizeof(command));
+    arr->buf = array_reserve(arr->arena, arr->buf, arr->cnt, &arr->cap, sizeof(command));
     memcpy(&arr->buf[arr->cnt++], cmd, sizeof(*cmd));
 }
 
@@ -68,13 +100,55 @@ command* command_array_at(command_array* arr, size_t idx)
 
 void command_array_free(command_array* arr)
 {
+    if (arr->arena)
+        return;
     for (size_t i = 0; i < arr->cnt; i++)
         string_array_free(&arr->buf[i].argv);
     free(arr->buf);
 }
 
-int command_array_run(command_array* arr, command** ocmd)
+static bool is_make_command(const command* cmd)
+{
+    const char* name = strrchr(cmd->proc, '/');
+    name = name ? name+1 : cmd->proc;
+    return strcmp(name, "make") == 0 || strcmp(name, "gmake") == 0;
+}
+
+static bool is_number(const char* str)
+{
+    if (!*str)
+        return false;
+    for (; *str; str++)
+        if (*str < '0' || *str > '9')
+            return false;
+    return true;
+}
+
+// Returns the amount of arguments, starting at argv[arg], that make up a job count passed to make
+// (-jN, -j N, --jobs=N, or --jobs N), or zero if there is none.
+static size_t make_jobs_argument(const string_array* argv, size_t arg)
 {
+    const char* str = argv->buf[arg];
+    const char* count = NULL;
+    if (strncmp(str, "-j", 2) == 0)
+        count = str+2;
+    else if (strncmp(str, "--jobs=", 7) == 0)
+        count = str+7;
+    else if (strcmp(str, "--jobs") == 0)
+        count = "";
+    else
+        return 0;
+    if (is_number(count))
+        return 1;
+    if (*count)
+        return 0;
+    return 1 + (arg+1 < argv->cnt && is_number(argv->buf[arg+1]));
+}
+
+int command_array_run(command_array* arr, const char* cwd, struct rusage* usage, command** ocmd)
+{
+    if (usage)
+        *usage = (struct rusage){};
     if (!arr->cnt)
         return 0;
     // for (size_t i = 0; i < arr->cnt; i++)
@@ -97,8 +171,18 @@ int command_array_run(command_array* arr, command** ocmd)
         cmd_str = malloc(cmd_str_size + 1);
         cmd_str[0] = 0;
         cmd_str[cmd_str_size] = 0;
+        bool is_make = jobserver_active() && is_make_command(cmd);
         for (size_t arg = 0; arg < cmd->argv.cnt; arg++)
         {
+            if (is_make)
+            {
+                size_t skip = make_jobs_argument(&cmd->argv, arg);
+                if (skip)
+                {
+                    arg += skip-1;
+                    continue;
+                }
+            }
             bool has_asterisk = strchr(cmd->argv.buf[arg], '*') != NULL;
             if (!has_asterisk)
                 strcat(cmd_str, "\"");
@@ -126,7 +210,7 @@ int command_array_run(command_array* arr, command** ocmd)
     string_array_append(&argv, "bash");
     string_array_append(&argv, "-c");
     string_array_append(&argv, cmds_str);
-    int ec = run_command("bash", argv);
+    int ec = run_command_ex("bash", argv, cwd, usage);
     free(cmds_str);
     if (ocmd)
         *ocmd = &arr->buf[0];
@@ -135,7 +219,7 @@ int command_array_run(command_array* arr, command** ocmd)
 
 void patch_array_append(patch_array* arr, patch* ptch)
 {
-    arr->buf = realloc(arr->buf, (arr->cnt+1)*sizeof(patch));
+    arr->buf = array_reserve(arr->arena, arr->buf, arr->cnt, &arr->cap, sizeof(patch));
     memcpy(&arr->buf[arr->cnt++], ptch, sizeof(*ptch));
 }
 
@@ -148,96 +232,109 @@ patch* patch_array_at(patch_array* arr, size_t idx)
 
 void patch_array_free(patch_array* arr)
 {
-    for (size_t i = 0; i < arr->cnt; i++)
-        free(&arr->buf[i]);
+    // The patches are stored inline, and their strings are not owned by the array.
+    if (arr->arena)
+        return;
     free(arr->buf);
 }
 
-static int parse_dollar_sign(char* dollar_sign, const char* fieldname, char** const arg_, size_t* const arglen_, size_t *nSubstituted, package* pkg);
+// If non-NULL, every environment variable substituted into a recipe
+// is appended to this array, as a (name, value) pair.
+static thread_local string_array* substituted_env;
 
-static const char* get_str_field(cJSON* parent, const char* fieldname)
-{
-    cJSON* child = cJSON_GetObjectItem(parent, fieldname);
-    return cJSON_GetStringValue(child);
-}
 const char* get_str_field_subst(cJSON* parent, const char* fieldname, package* pkg)
 {
-    const char* field = get_str_field(parent, fieldname);
+    const char* field = cJSON_GetStringValue(cJSON_GetObjectItem(parent, fieldname));
     if (!field)
         return NULL;
-    size_t len = strlen(field);
-    char* arg = memcpy(malloc(len+1), field, len);
-    arg[len] = 0;
-    char* iter = arg;
-    do {
-        char* dollar_sign = strchr(iter, '$');
-        if (!dollar_sign)
-            break;
-        if ((dollar_sign + 1) >= (arg+len))
-            break;
-        size_t dollar_sign_offset = dollar_sign-arg;
+    return subst_string(field, fieldname, pkg, substituted_env);
+}
 
-        size_t nSubstituted = 0;
-        int ec = parse_dollar_sign(dollar_sign, fieldname, &arg, &len, &nSubstituted, pkg);
-        if (ec != 0)
-            return NULL;
-        iter = arg + dollar_sign_offset;
-        dollar_sign = iter;
-        iter = dollar_sign + nSubstituted;
-    } while(1);
+// Returns NULL (and skips the value) if it is not a string.
+static char* get_str_value(json_stream* s)
+{
+    if (json_peek(s) != JSON_TYPE_STRING)
+    {
+        json_skip(s);
+        return NULL;
+    }
+    return json_string(s);
+}
 
-    return arg;
+static bool get_boolean_value(json_stream* s)
+{
+    int type = json_peek(s);
+    if (type == JSON_TYPE_NUMBER)
+    {
+        double val = 0;
+        json_number(s, &val);
+        return !!val;
+    }
+    json_skip(s);
+    return type == JSON_TYPE_TRUE;
 }
 
-static bool get_boolean_field(cJSON* parent, const char* fieldname, bool default_ret)
+// Returns zero if the value is not a positive number.
+static uint32_t get_resource_value(json_stream* s)
 {
-    cJSON *obj = cJSON_GetObjectItem(parent, fieldname);
-    if (!obj)
-        return default_ret;
-    return cJSON_IsTrue(obj);
+    double val = 0;
+    if (json_peek(s) != JSON_TYPE_NUMBER)
+        json_skip(s);
+    else if (!json_number(s, &val) || val < 0 || val > UINT32_MAX)
+        val = 0;
+    return (uint32_t)val;
 }
 
-static int get_str_array_field(cJSON* parent, const char* fieldname, string_array* arr)
+static void get_str_array_value(json_stream* s, const char* fieldname, string_array* arr)
 {
-    cJSON* child = cJSON_GetObjectItem(parent, fieldname);
-    if (!child)
-        return -1;
-    cJSON *i = NULL;
-    cJSON_ArrayForEach(i, child)
+    if (json_peek(s) != JSON_TYPE_ARRAY)
     {
-        if (!cJSON_IsString(i))
+        json_skip(s);
+        return;
+    }
+    bool first = true;
+    json_array_begin(s);
+    while (json_array_next(s, &first))
+    {
+        if (json_peek(s) != JSON_TYPE_STRING)
         {
             printf("%s: Invalid array value in package JSON in field '%s', ignoring.\n", g_argv[0], fieldname);
+            json_skip(s);
             continue;
         }
-        string_array_append(arr, cJSON_GetStringValue(i));
+        string_array_append_view(arr, json_string(s));
     }
-    return 0;
 }
 
-static int get_command_array(cJSON* parent, const char* fieldname, command_array* arr)
+static void get_command_array_value(json_stream* s, const char* fieldname, command_array* arr)
 {
-    cJSON* child = cJSON_GetObjectItem(parent, fieldname);
-    if (!child)
-        return -1;
-    cJSON *i = NULL;
-    cJSON_ArrayForEach(i, child)
+    if (json_peek(s) != JSON_TYPE_ARRAY)
+    {
+        json_skip(s);
+        return;
+    }
+    bool first = true;
+    json_array_begin(s);
+    while (json_array_next(s, &first))
     {
-        if (!cJSON_IsArray(i))
+        if (json_peek(s) != JSON_TYPE_ARRAY)
         {
             printf("%s: Invalid array value in package JSON in field '%s', ignoring.\n", g_argv[0], fieldname);
+            json_skip(s);
             continue;
         }
-        command cmd = {};
-        cJSON *j = NULL;
-        cJSON_ArrayForEach(j, i)
+        command cmd = {.argv.arena=arr->arena};
+        bool first_arg = true;
+        json_array_begin(s);
+        while (json_array_next(s, &first_arg))
         {
-            if (!cJSON_IsString(j))
+            if (json_peek(s) != JSON_TYPE_STRING)
             {
                 printf("%s: Invalid array value (expected string) in package JSON in field '%s', ignoring.\n", g_argv[0], fieldname);
+                json_skip(s);
                 continue;
             }
-            string_array_append(&cmd.argv, cJSON_GetStringValue(j));
+            string_array_append_view(&cmd.argv, json_string(s));
         }
         if (!cmd.argv.cnt)
         {
@@ -247,187 +344,6 @@ static int get_command_array(cJSON* parent, const char* fieldname, command_array
         cmd.proc = string_array_at(&cmd.argv, 0);
         command_array_append(arr, &cmd);
     }
-    return 0;
-}
-
-static int parse_dollar_sign(char* dollar_sign, const char* fieldname, char** const arg_, size_t* const arglen_, size_t *nSubstituted, package* pkg)
-{
-    char* arg = *arg_;
-    size_t arglen = *arglen_;
-    const char* subst_str = NULL;
-    size_t subst_len = 0;
-    bool subst_free = false;
-
-    const char *act = dollar_sign + 1;
-    // NOTE: This is the length from dollar_sign to the end of the key
-    size_t act_len = 0;
-    switch (*act)
-    {
-        case '$':
-        {
-            // Escape the dollar sign.
-            subst_str = "$";
-            subst_len = 1;
-            subst_free = false;
-            act_len = 2;
-            break;
-        }
-        case '{':
-        {
-            subst_str = act;
-            if (subst_str >= (arg+arglen))
-            {
-                *nSubstituted = 1;
-                return 0;
-            }
-            const char* iter = subst_str;
-            while (*iter != '}' && *iter)
-                iter++;
-            if (*iter != '}')
-            {
-                printf("%s: In field '%s': Syntax error trying to substitute %s", g_argv[0], fieldname, dollar_sign);
-                return -1;
-            }
-            subst_len = iter-subst_str-1;
-            subst_free = false;
-            act_len = subst_len+3;
-            subst_str++;
-
-            // Parse
-            if (strncmp(subst_str, "bootstrap_directory", subst_len) == 0)
-            {
-                subst_str = bootstrap_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "name", subst_len) == 0 && pkg)
-            {
-                subst_str = pkg->name;
-                subst_len = strlen(pkg->name);
-            }
-            else if (strncmp(subst_str, "description", subst_len) == 0 && pkg)
-            {
-                subst_str = pkg->description;
-                subst_len = strlen(pkg->description);
-            }
-            else if (strncmp(subst_str, "repo_directory", subst_len) == 0)
-            {
-                subst_str = repo_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "destdir", subst_len) == 0)
-            {
-                subst_str = destination_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "target_prefix", subst_len) == 0)
-            {
-                subst_str = prefix_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "prefix", subst_len) == 0 && pkg)
-            {
-                subst_str = pkg->host_package ? host_prefix_directory : prefix_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "host_prefix", subst_len) == 0)
-            {
-                subst_str = host_prefix_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "root_directory", subst_len) == 0)
-            {
-                subst_str = root_directory;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "nproc", subst_len) == 0)
-            {
-                subst_free = true;
-                int nproc = sysconf(_SC_NPROCESSORS_ONLN);
-                subst_len = snprintf(NULL, 0, "%d", nproc);
-                subst_str = malloc(subst_len+1);
-                snprintf((char*)subst_str, subst_len+1, "%d", nproc);
-            }
-            else if (strncmp(subst_str, "target_triplet", subst_len) == 0)
-            {
-                subst_str = g_config.target_triplet;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "host_triplet", subst_len) == 0)
-            {
-                subst_str = g_config.host_triplet;
-                subst_len = strlen(subst_str);
-            }
-            else if (strncmp(subst_str, "version", subst_len) == 0 && pkg)
-            {
-                subst_free = true;
-                subst_len = snprintf(NULL, 0, "%u.%u.%u", pkg->version.major, pkg->version.minor, pkg->version.patch);
-                subst_str = malloc(subst_len+1);
-                snprintf((char*)subst_str, subst_len+1, "%u.%u.%u", pkg->version.major, pkg->version.minor, pkg->version.patch);
-                ((char*)subst_str)[subst_len] = 0;
-            }
-            else if (strncmp(subst_str, "bin_package_prefix", subst_len) == 0 && pkg)
-            {
-                subst_str = package_make_bin_prefix(pkg);
-                subst_len = strlen(pkg->bin_package_prefix);
-                pkg->supports_binary_packages = true;
-            }
-            else
-            {
-                printf("%s: In field '%s': Invalid substitution key '%s', aborting.\n", g_argv[0], fieldname, dollar_sign);
-                return -1;
-            }
-
-            break;
-        }
-        default:
-        {
-            // Environment variable substitution.
-            subst_str = act;
-            if (subst_str >= (arg+arglen))
-            {
-                *nSubstituted = 1;
-                return 0;
-            }
-            const char* iter = subst_str;
-            while (!isspace(*iter) && *iter)
-                iter++;
-            subst_len = iter-subst_str;
-            subst_free = false;
-            act_len = subst_len+1;
-
-            // Fetch the enviornment variable.
-            char* env = malloc(subst_len+1);
-            memcpy(env, subst_str, subst_len);
-            env[subst_len] = 0;
-            subst_str = getenv(env);
-            free(env);
-            if (!subst_str)
-            {
-                printf("%s: In field '%s': Invalid environment variable '%s', aborting.\n", g_argv[0], fieldname, dollar_sign);
-                return -1;
-            }
-            subst_len = strlen(subst_str);
-            break;
-        }
-    }
-    // Replace the entire substitution.
-    *nSubstituted = act_len;
-#ifndef NDEBUG
-    printf("DEBUG: Substituition of %.*s with %.*s\n", (int)act_len, dollar_sign, (int)subst_len, subst_str);
-#endif
-    size_t new_len = arglen - act_len + subst_len;
-    char* newarg = malloc(new_len+1);
-    size_t front = dollar_sign - arg;
-    memcpy(newarg, arg, front);
-    memcpy(newarg + front, subst_str, subst_len);
-    memcpy(newarg + front + subst_len, arg+front+act_len, new_len-(front+subst_len));
-    newarg[new_len] = 0;
-    *nSubstituted = subst_len + (*act == '$');
-    *arg_ = newarg;
-    *arglen_ = new_len;
-    if (subst_free)
-        free((char*)subst_str);
-    return 0;
 }
 
 // Finds any substitutions that we need to make before executing the command (e.g., ${bootstrap_directory})
@@ -438,67 +354,102 @@ static int parse_command_array(const char* fieldname, package* pkg, command_arra
         for (size_t j = 0; j < arr->buf[i].argv.cnt; j++)
         {
             char* arg = arr->buf[i].argv.buf[j];
-            size_t arglen = strlen(arg);
-
-            char* iter = arg;
-            do {
-                char* dollar_sign = strchr(iter, '$');
-                if (!dollar_sign)
-                    break;
-                if ((dollar_sign + 1) >= (arg+arglen))
-                    break;
-                size_t dollar_sign_offset = dollar_sign-arg;
-
-                size_t nSubstituted = 0;
-                int ec = parse_dollar_sign(dollar_sign, fieldname, &arg, &arglen, &nSubstituted, pkg);
-                if (ec != 0)
-                    return ec;
-                iter = arg + dollar_sign_offset;
-                dollar_sign = iter;
-                iter = dollar_sign + nSubstituted;
-            } while(1);
-            arr->buf[i].argv.buf[j] = arg;
+            if (!strchr(arg, '$'))
+                continue;
+            char* new_arg = subst_string(arg, fieldname, pkg, substituted_env);
+            if (!new_arg)
+                return -1;
+            arr->buf[i].argv.buf[j] = new_arg;
             if (j == 0)
-                arr->buf[i].proc = arg;
+                arr->buf[i].proc = new_arg;
         }
     }
 
     return 0;
 }
 
-int get_patch_array(cJSON* parent, const char* fieldname, patch_array* arr)
+static void get_patch_array_value(json_stream* s, const char* fieldname, patch_array* arr)
 {
-    cJSON* child = cJSON_GetObjectItem(parent, fieldname);
-    if (!child)
-        return -1;
-    cJSON *i = NULL;
-    cJSON_ArrayForEach(i, child)
+    if (json_peek(s) != JSON_TYPE_ARRAY)
+    {
+        json_skip(s);
+        return;
+    }
+    bool first = true;
+    json_array_begin(s);
+    while (json_array_next(s, &first))
     {
-        if (!cJSON_IsObject(i))
+        if (json_peek(s) != JSON_TYPE_OBJECT)
         {
             printf("%s: Invalid array value in package JSON in field '%s', ignoring.\n", g_argv[0], fieldname);
+            json_skip(s);
             continue;
         }
         patch ptch = {};
-        ptch.patch = get_str_field(i, "patch");
-        if (!ptch.patch)
+        bool first_key = true;
+        char* key = NULL;
+        json_object_begin(s);
+        while (json_object_next(s, &first_key, &key))
         {
-            printf("%s: Invalid array value in package JSON in field '%s', ignoring.\n", g_argv[0], fieldname);
-            continue;
+            if (strcmp(key, "patch") == 0)
+                ptch.patch = get_str_value(s);
+            else if (strcmp(key, "modifies") == 0)
+                ptch.modifies = get_str_value(s);
+            else if (strcmp(key, "delete-file") == 0)
+                ptch.delete_file = get_boolean_value(s);
+            else
+                json_skip(s);
         }
-        ptch.modifies = get_str_field(i, "modifies");
-        if (!ptch.modifies)
+        if (!ptch.patch || !ptch.modifies)
         {
             printf("%s: Invalid array value in package JSON in field '%s', ignoring.\n", g_argv[0], fieldname);
             continue;
         }
-        do {
-            cJSON* child2 = cJSON_GetObjectItem(i, "delete-file");
-            ptch.delete_file = !child2 ? false : !!cJSON_GetNumberValue(child2);
-        } while (0);
         patch_array_append(arr, &ptch);
     }
-    return 0;
+}
+
+package* package_alloc()
+{
+    arena a = {};
+    package* pkg = arena_alloc(&a, sizeof(package));
+    memset(pkg, 0, sizeof(*pkg));
+    pkg->arena = a;
+    pkg->patches.arena = &pkg->arena;
+    pkg->depends.arena = &pkg->arena;
+    pkg->build_depends.arena = &pkg->arena;
+    pkg->build_commands.arena = &pkg->arena;
+    pkg->install_commands.arena = &pkg->arena;
+    pkg->bootstrap_commands.arena = &pkg->arena;
+    pkg->run_commands.arena = &pkg->arena;
+    pthread_mutex_init(&pkg->load_lock, NULL);
+    return pkg;
+}
+
+void package_free(package* pkg)
+{
+    if (!pkg)
+        return;
+    pthread_mutex_destroy(&pkg->load_lock);
+    if (pkg->backing)
+        munmap(pkg->backing, pkg->backing_size);
+    // The package lives in its own arena.
+    arena a = pkg->arena;
+    arena_free(&a);
+}
+
+int package_load_commands(package* pkg)
+{
+    if (atomic_load_explicit(&pkg->commands_loaded, memory_order_acquire))
+        return pkg->load_status;
+    pthread_mutex_lock(&pkg->load_lock);
+    if (!atomic_load_explicit(&pkg->commands_loaded, memory_order_relaxed))
+    {
+        pkg->load_status = pkg->load_commands ? pkg->load_commands(pkg) : 0;
+        atomic_store_explicit(&pkg->commands_loaded, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&pkg->load_lock);
+    return pkg->load_status;
 }
 
 char* package_make_bin_prefix(package* pkg)
@@ -509,231 +460,699 @@ char* package_make_bin_prefix(package* pkg)
     size_t len = 0;
 
     len = snprintf(NULL, 0, "%s/%s/obos-strap-bin/", bootstrap_directory, pkg->name);
-    buf = malloc(len+1);
+    buf = arena_alloc(&pkg->arena, len+1);
     snprintf(buf, len+1, "%s/%s/obos-strap-bin/", bootstrap_directory, pkg->name);
     pkg->bin_package_prefix = buf;
 
     return buf;
 }
 
-bool package_outdated(package* pkg, struct pkginfo* info, int since_state)
+char* package_make_staging_directory(package* pkg)
+{
+    if (pkg->staging_directory)
+        return pkg->staging_directory;
+    char* buf = NULL;
+    size_t len = 0;
+
+    len = snprintf(NULL, 0, "%s/%s/obos-strap-destdir", bootstrap_directory, pkg->name);
+    buf = arena_alloc(&pkg->arena, len+1);
+    snprintf(buf, len+1, "%s/%s/obos-strap-destdir", bootstrap_directory, pkg->name);
+    pkg->staging_directory = buf;
+
+    return buf;
+}
+
+static uint64_t hash_string_array(uint64_t hash, const string_array* arr)
+{
+    hash = hash_u64(hash, arr->cnt);
+    for (size_t i = 0; i < arr->cnt; i++)
+        hash = hash_string(hash, arr->buf[i]);
+    return hash;
+}
+
+static uint64_t hash_command_array(uint64_t hash, const command_array* arr)
+{
+    hash = hash_u64(hash, arr->cnt);
+    for (size_t i = 0; i < arr->cnt; i++)
+    {
+        hash = hash_string(hash, arr->buf[i].proc);
+        hash = hash_string_array(hash, &arr->buf[i].argv);
+    }
+    return hash;
+}
+
+// Patches are relative to the root directory.
+static uint64_t hash_file(uint64_t hash, const char* path)
+{
+    int fd = -1;
+    if (path[0] != '/')
+    {
+        size_t pathlen = snprintf(NULL, 0, "%s/%s", root_directory, path);
+        char* abs_path = malloc(pathlen+1);
+        snprintf(abs_path, pathlen+1, "%s/%s", root_directory, path);
+        fd = open(abs_path, O_RDONLY|O_CLOEXEC);
+        free(abs_path);
+    }
+    else
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return hash_string(hash, NULL);
+    char buf[8192];
+    ssize_t nRead = 0;
+    while ((nRead = read(fd, buf, sizeof(buf))) > 0)
+        hash = hash_buffer_ex(hash, buf, nRead);
+    close(fd);
+    return hash;
+}
+
+// Zero is reserved for "unknown".
+static uint64_t nonzero_hash(uint64_t hash)
+{
+    return hash ? hash : 1;
+}
+
+static void compute_stage_fingerprints(package* pkg, uint64_t* out)
+{
+    // Fetching, and patching.
+    uint64_t hash = HASH_INITIAL;
+    hash = hash_string(hash, pkg->name);
+    hash = hash_u64(hash, pkg->version.integer);
+    hash = hash_u64(hash, pkg->source_type);
+    switch (pkg->source_type)
+    {
+        case SOURCE_TYPE_GIT:
+            hash = hash_string(hash, pkg->source.git.git_url);
+            hash = hash_string(hash, pkg->source.git.git_commit);
+            break;
+        case SOURCE_TYPE_WEB:
+            hash = hash_string(hash, pkg->source.web.url);
+            break;
+        default:
+            break;
+    }
+    hash = hash_u64(hash, pkg->patches.cnt);
+    for (size_t i = 0; i < pkg->patches.cnt; i++)
+    {
+        const patch* ptch = &pkg->patches.buf[i];
+        hash = hash_string(hash, ptch->patch);
+        hash = hash_string(hash, ptch->modifies);
+        hash = hash_u64(hash, ptch->delete_file);
+        hash = hash_file(hash, ptch->patch);
+    }
+    out[BUILD_STATE_FETCHED-1] = nonzero_hash(hash);
+
+    // Commands are hashed after substitution, so this covers whatever was substituted into them.
+    // Settings are part of the bootstrap stage, as that is the earliest stage they can affect.
+    hash = hash_command_array(HASH_INITIAL, &pkg->bootstrap_commands);
+    hash = hash_string_array(hash, &pkg->depends);
+    hash = hash_string_array(hash, &pkg->build_depends);
+    hash = hash_u64(hash, pkg->host_package);
+    hash = hash_string(hash, pkg->host_package ? g_config.host_triplet : g_config.target_triplet);
+    hash = hash_u64(hash, g_config.cross_compiling);
+    hash = hash_string(hash, prefix_directory);
+    hash = hash_u64(hash, g_config.environment_hash);
+    out[BUILD_STATE_CONFIGURED-1] = nonzero_hash(hash);
+
+    hash = hash_command_array(HASH_INITIAL, &pkg->build_commands);
+    out[BUILD_STATE_BUILT-1] = nonzero_hash(hash);
+
+    hash = hash_command_array(HASH_INITIAL, &pkg->install_commands);
+    hash = hash_u64(hash, pkg->supports_binary_packages);
+    out[BUILD_STATE_INSTALLED-1] = nonzero_hash(hash);
+}
+
+void package_stage_fingerprints(package* pkg, uint64_t* out)
+{
+    if (package_load_commands(pkg) != 0)
+    {
+        for (int i = 0; i < BUILD_STATE_INSTALLED; i++)
+            out[i] = 1;
+        return;
+    }
+    pthread_mutex_lock(&pkg->load_lock);
+    if (!pkg->fingerprint)
+    {
+        compute_stage_fingerprints(pkg, pkg->stage_fingerprints);
+        pkg->fingerprint = nonzero_hash(hash_buffer(pkg->stage_fingerprints, sizeof(pkg->stage_fingerprints)));
+    }
+    memcpy(out, pkg->stage_fingerprints, sizeof(pkg->stage_fingerprints));
+    pthread_mutex_unlock(&pkg->load_lock);
+}
+
+uint64_t package_fingerprint(package* pkg)
 {
+    uint64_t unused[BUILD_STATE_INSTALLED];
+    package_stage_fingerprints(pkg, unused);
+    // Set by package_stage_fingerprints, and never changed afterwards.
+    return pkg->fingerprint ? pkg->fingerprint : 1;
+}
+
+static uint64_t hash_dependency_outputs(uint64_t hash, const string_array* arr)
+{
+    for (size_t i = 0; i < arr->cnt; i++)
+    {
+        char* depend = NULL;
+        union package_version version = {};
+        int version_cmp = VERSION_CMP_NONE;
+        parse_depend_expr(arr->buf[i], &depend, &version, &version_cmp);
+        if (!depend)
+            continue;
+        struct pkginfo* info = read_package_info_ex(depend, false, false);
+        hash = hash_string(hash, depend);
+        hash = hash_u64(hash, info ? info->output_hash : 0);
+        free(info);
+        if (version_cmp != VERSION_CMP_NONE)
+            free(depend);
+    }
+    return hash;
+}
+
+uint64_t package_dependency_output_hash(package* pkg)
+{
+    uint64_t hash = hash_dependency_outputs(HASH_INITIAL, &pkg->build_depends);
+    hash = hash_dependency_outputs(hash, &pkg->depends);
+    return nonzero_hash(hash);
+}
+
+int package_invalidated_state(package* pkg, struct pkginfo* info)
+{
+    // Built before per-stage fingerprints were recorded.
+    if (!info->stage_fingerprints[BUILD_STATE_FETCHED-1])
+        return BUILD_STATE_CLEAN;
+    uint64_t fingerprints[BUILD_STATE_INSTALLED];
+    package_stage_fingerprints(pkg, fingerprints);
+    for (int state = BUILD_STATE_FETCHED; state <= info->build_state; state++)
+    {
+        if (info->stage_fingerprints[state-1] != fingerprints[state-1])
+            return state-1;
+        // The output of the dependencies is an input of the bootstrap stage, and every one after it.
+        if (state == BUILD_STATE_CONFIGURED && info->dependency_output_hash &&
+            info->dependency_output_hash != package_dependency_output_hash(pkg))
+            return state-1;
+    }
+    return info->build_state;
+}
+
+int package_outdated_reason(package* pkg, struct pkginfo* info, int since_state, int* state)
+{
+    int dummy = 0;
+    if (!state)
+        state = &dummy;
+    *state = BUILD_STATE_CLEAN;
     if (!pkg)
-        return false; // a package that doesn't exist isn't outdated (or is it?)
+        return OUTDATED_REASON_NONE; // a package that doesn't exist isn't outdated (or is it?)
+    struct pkginfo* our_info = NULL;
     if (!info)
-        info = read_package_info(pkg->name);
+        info = our_info = read_package_info(pkg->name);
     assert(info);
 
+    int reason = OUTDATED_REASON_NONE;
     // If we change package host triplets
     if (strncmp(pkg->host_package ? g_config.host_triplet : g_config.target_triplet, info->host_triplet, info->host_triplet_len) != 0)
-        return true;
-   
-    if (info->build_state > since_state)
-        return true;
-    
-    if (!do_version_cmp(VERSION_CMP_EQUAL, info->version, pkg->version))
-        return true;
-    
-    struct timeval file_time = pkg->recipe_mod_time;    
-    struct timeval cmp_time = info->build_times[info->build_state - BUILD_STATE_CONFIGURED];
+        reason = OUTDATED_REASON_TRIPLET;
+    else if (info->build_state > since_state)
+        reason = OUTDATED_REASON_STAGE;
+    else if (!do_version_cmp(VERSION_CMP_EQUAL, info->version, pkg->version))
+        reason = OUTDATED_REASON_VERSION;
+    else if (info->stage_fingerprints[BUILD_STATE_FETCHED-1])
+    {
+        *state = package_invalidated_state(pkg, info);
+        if (*state < info->build_state)
+        {
+            // Otherwise, the only input that changed was the output of the dependencies.
+            uint64_t fingerprints[BUILD_STATE_INSTALLED];
+            package_stage_fingerprints(pkg, fingerprints);
+            reason = info->stage_fingerprints[*state] != fingerprints[*state] ?
+                OUTDATED_REASON_RECIPE : OUTDATED_REASON_DEPENDENCY;
+        }
+    }
+    // The package was last built before fingerprints were recorded, so fall back
+    // to comparing the recipe's modification time with when it was built.
+    else if (info->build_state < BUILD_STATE_CONFIGURED)
+        reason = OUTDATED_REASON_STAGE;
+    else
+    {
+        struct timeval file_time = pkg->recipe_mod_time;    
+        struct timeval cmp_time = info->build_times[info->build_state - BUILD_STATE_CONFIGURED];
+        if (timercmp(&cmp_time, &file_time, <))
+            reason = OUTDATED_REASON_RECIPE;
+    }
 
-    return timercmp(&cmp_time, &file_time, <);
+    if (!reason)
+        *state = info->build_state;
+    free(our_info);
+    return reason;
+}
+
+bool package_outdated(package* pkg, struct pkginfo* info, int since_state)
+{
+    return package_outdated_reason(pkg, info, since_state, NULL) != OUTDATED_REASON_NONE;
 }
 
-static bool get_version(cJSON* context, const char* field_name, union package_version* out)
+static bool get_version_value(json_stream* s, union package_version* out)
 {
-    cJSON* child_ctx = cJSON_GetObjectItem(context, field_name);
-    if (!child_ctx)
+    if (json_peek(s) != JSON_TYPE_ARRAY)
+    {
+        json_skip(s);
         return false;
+    }
     union package_version ret = {};
-    cJSON *elements[3] = {
-        cJSON_GetArrayItem(child_ctx, 0),
-        cJSON_GetArrayItem(child_ctx, 1),
-        cJSON_GetArrayItem(child_ctx, 2),
-    };
-    for (int i = 0; i < 3; i++)
-        if (elements[i] ? !cJSON_IsNumber(elements[i]) : false)
-            return false;
-    for (int i = 0; i < 3; i++)
-        ret.arr[i] = elements[i] ? (int)cJSON_GetNumberValue(elements[i]) : 0;
-    *out = ret;
-    return true;
+    bool valid = true;
+    bool first = true;
+    json_array_begin(s);
+    for (int i = 0; json_array_next(s, &first); i++)
+    {
+        if (i >= 3)
+        {
+            json_skip(s);
+            continue;
+        }
+        double val = 0;
+        if (json_peek(s) != JSON_TYPE_NUMBER)
+        {
+            valid = false;
+            json_skip(s);
+            continue;
+        }
+        json_number(s, &val);
+        ret.arr[i] = (int)val;
+    }
+    if (valid)
+        *out = ret;
+    return valid;
 }
 
-package* get_package(const char* pkg_name)
+// Where the fields loaded by package_load_commands start in the recipe, NULL if they are not present.
+// These are skipped over by parse_package_json without being touched.
+typedef struct recipe_lazy_fields {
+    char* patches;
+    char* host_provides;
+    char* bootstrap_commands;
+    char* build_commands;
+    char* install_commands;
+    char* run_commands;
+} recipe_lazy_fields;
+
+// Skips over a command field, which is loaded by package_load_commands, and returns where it starts.
+// Packages that substitute ${bin_package_prefix} in their commands support binary packages,
+// which must be known before the commands are loaded.
+static char* skip_command_field(json_stream* s, package* pkg)
 {
-    if (strlen(pkg_name) == 0)
-        return NULL;
-
-    char* pkg_path = NULL;
-    size_t sz_path = snprintf(pkg_path, 0, "%s/%s.json", recipes_directory, pkg_name);
-    pkg_path = malloc(sz_path + 1);
-    pkg_path[sz_path] = 0;
-    snprintf(pkg_path, sz_path+1, "%s/%s.json", recipes_directory, pkg_name);
-
-    // FIXME: TOCTOU?
+    char* start = s->iter;
+    json_skip(s);
+    if (!s->error && subst_mentions_key(start, s->iter - start, SUBST_KEY_BIN_PACKAGE_PREFIX))
+        pkg->supports_binary_packages = true;
+    return start;
+}
 
-    struct stat st = {};
-    if (stat(pkg_path, &st) == -1)
-        return NULL;
+static int load_command_array_field(package* pkg, char* where, const char* fieldname, command_array* arr)
+{
+    if (!where)
+        return 0;
+    json_stream s = {.iter=where, .end=(char*)pkg->backing + pkg->backing_size};
+    get_command_array_value(&s, fieldname, arr);
+    return parse_command_array(fieldname, pkg, arr);
+}
 
-    FILE* pkg_json = fopen(pkg_path, "r");
-    if (!pkg_json)
-        return NULL;
+static int load_recipe_commands(package* pkg)
+{
+    recipe_lazy_fields* fields = pkg->lazy_data;
+    char* end = (char*)pkg->backing + pkg->backing_size;
+    if (fields->patches)
+    {
+        json_stream s = {.iter=fields->patches, .end=end};
+        get_patch_array_value(&s, "patches", &pkg->patches);
+    }
+    if (pkg->host_package && fields->host_provides)
+    {
+        json_stream s = {.iter=fields->host_provides, .end=end};
+        const char* host_provides = get_str_value(&s);
+        if (host_provides)
+            pkg->host_provides = subst_string(host_provides, "host-provides", pkg, substituted_env);
+    }
 
-    char* json_data = malloc(st.st_size);
-    fread(json_data, st.st_size, st.st_size, pkg_json);
+    if (load_command_array_field(pkg, fields->bootstrap_commands, "bootstrap-commands", &pkg->bootstrap_commands) != 0)
+        return -1;
+    if (load_command_array_field(pkg, fields->build_commands, "build-commands", &pkg->build_commands) != 0)
+        return -1;
+    if (load_command_array_field(pkg, fields->install_commands, "install-commands", &pkg->install_commands) != 0)
+        return -1;
+    load_command_array_field(pkg, fields->run_commands, "run-commands", &pkg->run_commands);
 
-    fclose(pkg_json);
+    return 0;
+}
 
-    cJSON* context = cJSON_Parse(json_data);
-    if (!context)
+// Parses the package's metadata in one pass over json_data, which is modified in-place (see json_stream.h).
+// Everything else is loaded by package_load_commands.
+// NOTE: json_data becomes the package's backing, on success.
+static package* parse_package_json(char* json_data, size_t len, const char* pkg_path, const struct stat* st)
+{
+    package* pkg = package_alloc();
+    recipe_lazy_fields* lazy = arena_alloc(&pkg->arena, sizeof(recipe_lazy_fields));
+    memset(lazy, 0, sizeof(*lazy));
+
+    bool has_version = false;
+    bool has_depends = false;
+    bool has_build_depends = false;
+    bool has_git_url = false;
+    bool has_url = false;
+    bool has_bootstrap_commands = false;
+    bool has_build_commands = false;
+    bool has_install_commands = false;
+    bool host_package = false;
+    // NOTE: These are in a union in the package, so they can only be stored once the source type is known.
+    const char* git_url = NULL;
+    const char* git_commit = NULL;
+    const char* url = NULL;
+
+    json_stream s = {.iter=json_data, .end=json_data+len};
+    bool first = true;
+    char* key = NULL;
+    if (json_object_begin(&s))
+    {
+        while (json_object_next(&s, &first, &key))
+        {
+            if (strcmp(key, "name") == 0)
+                pkg->name = get_str_value(&s);
+            else if (strcmp(key, "description") == 0)
+                pkg->description = get_str_value(&s);
+            else if (strcmp(key, "version") == 0)
+                has_version = get_version_value(&s, &pkg->version);
+            else if (strcmp(key, "depends") == 0)
+            {
+                has_depends = true;
+                get_str_array_value(&s, key, &pkg->depends);
+            }
+            else if (strcmp(key, "build-depends") == 0)
+            {
+                has_build_depends = true;
+                get_str_array_value(&s, key, &pkg->build_depends);
+            }
+            else if (strcmp(key, "host-package") == 0)
+                host_package = get_boolean_value(&s);
+            else if (strcmp(key, "host-provides") == 0)
+            {
+                lazy->host_provides = s.iter;
+                json_skip(&s);
+            }
+            else if (strcmp(key, "inhibit-auto-rebuild") == 0)
+            {
+                pkg->inhibit_auto_rebuild = json_peek(&s) == JSON_TYPE_TRUE;
+                json_skip(&s);
+            }
+            else if (strcmp(key, "memory") == 0)
+                pkg->memory = get_resource_value(&s);
+            else if (strcmp(key, "cpu-weight") == 0)
+                pkg->cpu_weight = get_resource_value(&s);
+            else if (strcmp(key, "git-url") == 0)
+            {
+                has_git_url = true;
+                git_url = get_str_value(&s);
+            }
+            else if (strcmp(key, "git-commit") == 0)
+                git_commit = get_str_value(&s);
+            else if (strcmp(key, "url") == 0)
+            {
+                has_url = true;
+                url = get_str_value(&s);
+            }
+            else if (strcmp(key, "patches") == 0)
+            {
+                lazy->patches = s.iter;
+                json_skip(&s);
+            }
+            else if (strcmp(key, "bootstrap-commands") == 0)
+            {
+                has_bootstrap_commands = true;
+                lazy->bootstrap_commands = skip_command_field(&s, pkg);
+            }
+            else if (strcmp(key, "build-commands") == 0)
+            {
+                has_build_commands = true;
+                lazy->build_commands = skip_command_field(&s, pkg);
+            }
+            else if (strcmp(key, "install-commands") == 0)
+            {
+                has_install_commands = true;
+                lazy->install_commands = skip_command_field(&s, pkg);
+            }
+            else if (strcmp(key, "run-commands") == 0)
+            {
+                lazy->run_commands = skip_command_field(&s, pkg);
+            }
+            else
+                json_skip(&s);
+        }
+    }
+    if (s.error)
     {
         printf("%s: Parsing package JSON failed.\n", g_argv[0]);
-        free(json_data);
+        package_free(pkg);
         return NULL;
     }
 
-    package* pkg = calloc(1, sizeof(package));
-
-    pkg->recipe_mod_time.tv_sec = st.st_mtim.tv_sec;
-    pkg->recipe_mod_time.tv_usec = st.st_mtim.tv_nsec / 1000;
-
-    pkg->inhibit_auto_rebuild = get_boolean_field(context, "inhibit-auto-rebuild", false);
+    pkg->recipe_mod_time.tv_sec = st->st_mtim.tv_sec;
+    pkg->recipe_mod_time.tv_usec = st->st_mtim.tv_nsec / 1000;
 
     // Populate the package info.
-    pkg->config_file_path = pkg_path;
-    pkg->name = get_str_field(context, "name");
+    pkg->config_file_path = arena_strdup(&pkg->arena, pkg_path);
     if (!pkg->name)
     {
         printf("%s: Invalid format or missing field 'name' in package JSON.\n", g_argv[0]);
-        free(json_data);
+        package_free(pkg);
         return NULL;
     }
-    if (!get_version(context, "version", &pkg->version))
+    // Computed up front, so that the package is never mutated once it is shared.
+    package_make_bin_prefix(pkg);
+    if (!has_version)
     {
         printf("%s: Invalid format or missing field 'version' in package JSON.\n", g_argv[0]);
-        free(json_data);
+        package_free(pkg);
         return NULL;
     }
 
-    if (get_str_array_field(context, "depends", &pkg->depends) != 0)
+    if (!has_depends)
     {
         printf("%s: Invalid format or missing field 'depends' in package JSON.\n", g_argv[0]);
-        free(json_data);
+        package_free(pkg);
         return NULL;
     }
 
-    if (get_str_array_field(context, "build-depends", &pkg->build_depends) != 0)
+    if (!has_build_depends)
     {
         printf("%s: Invalid format or missing field 'build-depends' in package JSON.\n", g_argv[0]);
-        free(json_data);
+        package_free(pkg);
         return NULL;
     }
 
-    do {
-        cJSON* child = cJSON_GetObjectItem(context, "host-package");
-        pkg->host_package = !child ? false : (!!cJSON_GetNumberValue(child) && g_config.cross_compiling);
-    } while (0);
+    pkg->host_package = host_package && g_config.cross_compiling;
 
-    if (cJSON_HasObjectItem(context, "git-url"))
+    if (has_git_url)
     {
-        pkg->source.git.git_url = get_str_field(context, "git-url");
-        pkg->source.git.git_commit  = get_str_field(context, "git-commit");
+        pkg->source.git.git_url = git_url;
+        pkg->source.git.git_commit = git_commit;
         if (!pkg->source.git.git_url)
         {
             printf("%s: Invalid field 'git-url' in json package.\n", g_argv[0]);
-            free(json_data);
-            free(pkg);
-            cJSON_free(context);
+            package_free(pkg);
             return NULL;
         }
         if (!pkg->source.git.git_commit)
         {
             printf("%s: Invalid format or missing field 'git-commit' in package JSON.\n", g_argv[0]);
-            free(json_data);
-            free(pkg);
-            cJSON_free(context);
+            package_free(pkg);
             return NULL;
         }
         pkg->source_type = SOURCE_TYPE_GIT;
     }
-    else if (cJSON_HasObjectItem(context, "url"))
+    else if (has_url)
     {
-        pkg->source.web.url = get_str_field(context, "url");
+        pkg->source.web.url = url;
         pkg->source_type = SOURCE_TYPE_WEB;
     }
     else
         pkg->source_type = SOURCE_TYPE_SOURCELESS;
-/*  else
+
+    if (!has_bootstrap_commands)
+    {
+        printf("%s: Invalid format or missing field 'bootstrap-commands' in package JSON.\n", g_argv[0]);
+        package_free(pkg);
+        return NULL;
+    }
+    if (!has_build_commands)
+    {
+        printf("%s: Invalid format or missing field 'build-commands' in package JSON.\n", g_argv[0]);
+        package_free(pkg);
+        return NULL;
+    }
+    if (!has_install_commands)
     {
-        printf("%s: Could not determine package source for package '%s'\n", g_argv[0], pkg->name);
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
+        printf("%s: Invalid format or missing field 'install-commands' in package JSON.\n", g_argv[0]);
+        package_free(pkg);
         return NULL;
-    }*/
+    }
 
-    get_patch_array(context, "patches", &pkg->patches);
-    if (pkg->host_package)
-        pkg->host_provides = get_str_field_subst(context, "host-provides", pkg);
+    pkg->backing = json_data;
+    pkg->backing_size = len;
+    pkg->lazy_data = lazy;
+    pkg->load_commands = load_recipe_commands;
+    return pkg;
+}
 
-    pkg->description = get_str_field(context, "description");
+static package* parse_package(const char* pkg_path, const char* pkg_name, const struct stat* st)
+{
+    int fd = open(pkg_path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
 
-    if (get_command_array(context, "bootstrap-commands", &pkg->bootstrap_commands) != 0)
+    // The size is taken from the open file, as the recipe might have changed since st was filled.
+    struct stat fd_st = {};
+    fstat(fd, &fd_st);
+    if (!fd_st.st_size)
     {
-        printf("%s: Invalid format or missing field 'bootstrap-commands' in package JSON.\n", g_argv[0]);
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
+        close(fd);
+        printf("%s: Parsing package JSON failed.\n", g_argv[0]);
         return NULL;
     }
-    if (get_command_array(context, "build-commands", &pkg->build_commands) != 0)
+    // A private, writable mapping, so that the parser can decode strings in-place
+    // without ever writing to the recipe itself.
+    char* json_data = mmap(NULL, fd_st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (json_data == MAP_FAILED)
     {
-        printf("%s: Invalid format or missing field 'bootstrap-commands' in package JSON.\n", g_argv[0]);
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
+        perror("mmap");
         return NULL;
     }
-    if (get_command_array(context, "install-commands", &pkg->install_commands) != 0)
+
+    uint64_t recipe_hash = hash_buffer(json_data, fd_st.st_size);
+    package* pkg = recipe_cache_load(pkg_name, recipe_hash);
+    if (pkg)
     {
-        printf("%s: Invalid format or missing field 'bootstrap-commands' in package JSON.\n", g_argv[0]);
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
-        return NULL;
+        pkg->config_file_path = arena_strdup(&pkg->arena, pkg_path);
+        pkg->recipe_mod_time.tv_sec = st->st_mtim.tv_sec;
+        pkg->recipe_mod_time.tv_usec = st->st_mtim.tv_nsec / 1000;
+        munmap(json_data, fd_st.st_size);
+        return pkg;
     }
 
-    if (parse_command_array("bootstrap-commands", pkg, &pkg->bootstrap_commands) != 0)
+    pkg = parse_package_json(json_data, fd_st.st_size, pkg_path, st);
+    if (!pkg)
     {
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
+        munmap(json_data, fd_st.st_size);
         return NULL;
     }
-    if (parse_command_array("build-commands", pkg, &pkg->build_commands) != 0)
+    if (!recipe_cache_directory)
+        return pkg;
+
+    // The cache entry must hold the whole package, so everything is loaded now,
+    // and later runs get the package lazily from the cache instead.
+    string_array env = {};
+    substituted_env = &env;
+    int ec = package_load_commands(pkg);
+    substituted_env = NULL;
+    if (ec == 0)
+        recipe_cache_store(pkg_name, recipe_hash, pkg, &env);
+    string_array_free(&env);
+    if (ec != 0)
     {
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
+        package_free(pkg);
         return NULL;
     }
-    if (parse_command_array("install-commands", pkg, &pkg->install_commands) != 0)
+    return pkg;
+}
+
+// Every package that has been parsed by this process, keyed by recipe name.
+// An entry is only reused if the recipe has not been modified since it was parsed.
+typedef struct registry_node {
+    const char* name;
+    package* pkg;
+    struct timespec recipe_mtim;
+    off_t recipe_size;
+    RB_ENTRY(registry_node) node;
+} registry_node;
+
+typedef RB_HEAD(package_registry, registry_node) package_registry;
+static package_registry registry = RB_INITIALIZER(&registry);
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_registry_nodes(registry_node* lhs, registry_node* rhs)
+{
+    return strcmp(lhs->name, rhs->name);
+}
+
+RB_GENERATE_STATIC(package_registry, registry_node, node, cmp_registry_nodes);
+
+static bool registry_node_valid(const registry_node* node, const struct stat* st)
+{
+    return node->recipe_mtim.tv_sec == st->st_mtim.tv_sec &&
+           node->recipe_mtim.tv_nsec == st->st_mtim.tv_nsec &&
+           node->recipe_size == st->st_size;
+}
+
+package* get_package(const char* pkg_name)
+{
+    if (strlen(pkg_name) == 0)
+        return NULL;
+
+    char* pkg_path = NULL;
+    size_t sz_path = snprintf(pkg_path, 0, "%s/%s.json", recipes_directory, pkg_name);
+    pkg_path = malloc(sz_path + 1);
+    pkg_path[sz_path] = 0;
+    snprintf(pkg_path, sz_path+1, "%s/%s.json", recipes_directory, pkg_name);
+
+    struct stat st = {};
+    if (stat(pkg_path, &st) == -1)
     {
-        free(json_data);
-        free(pkg);
-        cJSON_free(context);
+        free(pkg_path);
         return NULL;
     }
 
-    if (get_command_array(context, "run-commands", &pkg->run_commands) == 0)
-        parse_command_array("run-commands", pkg, &pkg->run_commands);
+    registry_node what = {.name=pkg_name};
+    pthread_mutex_lock(&registry_lock);
+    registry_node* found = RB_FIND(package_registry, &registry, &what);
+    if (found && registry_node_valid(found, &st))
+    {
+        pthread_mutex_unlock(&registry_lock);
+        free(pkg_path);
+        return found->pkg;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    // Parse without holding the lock, so that threads loading
+    // different recipes do not wait on each other.
+    package* pkg = parse_package(pkg_path, pkg_name, &st);
+    free(pkg_path);
+    if (!pkg)
+        return NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    found = RB_FIND(package_registry, &registry, &what);
+    if (found && registry_node_valid(found, &st))
+    {
+        // Another thread beat us to it, use its copy so every caller
+        // sees the same object.
+        pthread_mutex_unlock(&registry_lock);
+        package_free(pkg);
+        return found->pkg;
+    }
+    if (!found)
+    {
+        found = calloc(1, sizeof(registry_node));
+        assert(found);
+        size_t name_len = strlen(pkg_name);
+        found->name = memcpy(malloc(name_len+1), pkg_name, name_len+1);
+        RB_INSERT(package_registry, &registry, found);
+    }
+    // NOTE: If the recipe was modified, the stale package is left alone,
+    // as other callers might still be holding onto it.
+    found->pkg = pkg;
+    found->recipe_mtim = st.st_mtim;
+    found->recipe_size = st.st_size;
+    pthread_mutex_unlock(&registry_lock);
 
     return pkg;
 }
 
-#define pkg_info_format "%s/pkginfo_%s.bin"
 struct pkginfo* read_package_info(const char* pkg_name)
 {
     return read_package_info_ex(pkg_name, true, true);
@@ -741,47 +1160,17 @@ struct pkginfo* read_package_info(const char* pkg_name)
 
 struct pkginfo* read_package_info_ex(const char* pkg_name, bool create, bool validate)
 {
-    size_t pathlen = snprintf(NULL, 0, pkg_info_format, pkg_info_directory, pkg_name);
-    char* path = malloc(pathlen+1);
-    snprintf(path, pathlen+1, pkg_info_format, pkg_info_directory, pkg_name);
-    FILE* file = fopen(path, "r+");
-    if (!file)
+    struct pkginfo* info = state_db_read(pkg_name);
+    if (!info)
     {
-        if (errno != ENOENT)
-            perror("fopen");
-        else if (create) {
-            struct pkginfo* info = calloc(1, sizeof(struct pkginfo));
+        if (create) {
+            info = calloc(1, sizeof(struct pkginfo));
             info->build_state = BUILD_STATE_CLEAN;
-            file = fopen(path, "w");
-            if (file)
-            {
-                fwrite(info, sizeof(*info), 1, file);
-                fclose(file);
-            }
-            free(path);
+            state_db_write(pkg_name, info);
             return info;
         }
         return NULL;
     }
-    free(path);
-    struct stat st = {};
-    fstat(fileno(file), &st);
-    struct pkginfo* info = malloc(st.st_size+1);
-    size_t nRead = 0;
-    while ((nRead += fread(((char*)info) + nRead, 1, st.st_size - nRead, file)) < st.st_size)
-    {
-        if (feof(file))
-        {
-            fprintf(stderr, "Unexpected EOF while reading pkginfo for package '%s'\n", pkg_name);
-            abort();
-        }
-        else if (ferror(file))
-        {
-            fprintf(stderr, "Unexpected error '%s' while reading pkginfo for package '%s'\n", strerror(errno), pkg_name);
-            abort();
-        }
-    }
-    fclose(file);
 
     if (info->build_state > BUILD_STATE_INSTALLED)
     {
@@ -959,87 +1348,26 @@ bool do_version_cmp(int how, union package_version lhs, union package_version rh
 
 void write_package_info(const char* pkg_name, struct pkginfo* info)
 {
-    size_t pathlen = snprintf(NULL, 0, pkg_info_format, pkg_info_directory, pkg_name);
-    char* path = malloc(pathlen+1);
-    snprintf(path, pathlen+1, pkg_info_format, pkg_info_directory, pkg_name);
-    FILE* file = fopen(path, "r+");
-    free(path);
-    if (!file)
-    {
-        perror("fopen");
-        return;
-    }
-    size_t nWritten = 0;
-    while ((nWritten += fwrite(((char*)info) + nWritten, 1, sizeof(*info) + info->host_triplet_len - nWritten, file)) < sizeof(*info)+info->host_triplet_len)
-    {
-        if (ferror(file))
-        {
-            fprintf(stderr, "Unexpected error '%s' while reading pkginfo for package '%s'\n", strerror(errno), pkg_name);
-            abort();
-        }
-    }
-    fclose(file);
+    state_db_write(pkg_name, info);
 }
 
 void foreach_package(bool installed_only, int(*cb)(package* pkg, struct pkginfo* info, void *userdata), void *userdata)
 {
-    DIR* iter = NULL;
-    if (installed_only)
-        iter = opendir(pkg_info_directory);
-    else
-        iter = opendir(recipes_directory);
-    assert(iter);
-    if (!iter)
-        return;
-    struct dirent* ent = NULL;
-    while ((ent = readdir(iter)) != NULL)
+    const recipe_index* index = get_recipe_index();
+    for (size_t i = 0; i < index->cnt; i++)
     {
-        if (ent->d_type != DT_REG)
+        const char* pkg_name = index->entries[i].name;
+        struct pkginfo* info = read_package_info_ex(pkg_name, false, false);
+        if (!info && installed_only)
             continue;
-        const char* filename = ent->d_name;
-        char* pkg_name = NULL;
-        if (!installed_only)
-        {
-            char* end_recipe_name = strrchr(filename, '.');
-            if (!end_recipe_name)
-            {
-                printf("Invalid recipe filename %s\n", filename);
-                continue; // weirdness
-            }
-            size_t len_recipe_name = end_recipe_name - filename;
-            pkg_name = memcpy(malloc(len_recipe_name+1), filename, len_recipe_name);
-            pkg_name[len_recipe_name] = 0;
-        }
-        else
-        {
-            char* pkg_name_start = strchr(filename, '_');
-            if (!pkg_name_start)
-                continue; // probably just the README?
-            pkg_name_start++;
-            char* end_recipe_name = strrchr(pkg_name_start, '.');
-            if (!end_recipe_name)
-            {
-                printf("Invalid pkginfo filename %s\n", pkg_name_start);
-                continue; // weirdness
-            }
-            size_t len_recipe_name = end_recipe_name - pkg_name_start;
-            pkg_name = memcpy(malloc(len_recipe_name+1), pkg_name_start, len_recipe_name);
-            pkg_name[len_recipe_name] = 0;
-        }
         package* pkg = get_package(pkg_name);
         if (!pkg)
         {
             printf("Warning: Could not get package '%s'\n", pkg_name);
-            free(pkg_name);
+            free(info);
             continue;
         }
-        struct pkginfo* info = read_package_info_ex(pkg_name, false, false);
         if (cb(pkg, info, userdata) != 0)
-        {
-            free(pkg_name);
             break;
-        }
-        free(pkg_name);
     }
-    closedir(iter);
 }
@@ -9,11 +9,20 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
+#include "arena.h"
+
+// If arena is non-NULL, the array's buffer and strings are allocated from it, and are
+// only freed along with the arena; the *_array_free functions do nothing for such arrays.
 typedef struct string_array {
     char** buf;
     size_t cnt;
+    size_t cap;
+    arena* arena;
 } string_array;
 
 void string_array_append(string_array* arr, const char* str);
@@ -28,12 +37,16 @@ typedef struct command {
 typedef struct command_array {
     command* buf;
     size_t cnt;
+    size_t cap;
+    arena* arena;
 } command_array;
 
 void command_array_append(command_array* arr, command* cmd);
 command* command_array_at(command_array* arr, size_t idx);
 void command_array_free(command_array* arr);
-int command_array_run(command_array* arr, command** cmd);
+// Runs the commands in cwd, or the current directory if it is NULL.
+// If usage is not NULL, it is set to the resources used by the commands (see run_command_ex).
+int command_array_run(command_array* arr, const char* cwd, struct rusage* usage, command** cmd);
 
 typedef struct patch {
     const char* patch;
@@ -43,6 +56,8 @@ typedef struct patch {
 typedef struct patch_array {
     patch* buf;
     size_t cnt;
+    size_t cap;
+    arena* arena;
 } patch_array;
 void patch_array_append(patch_array* arr, patch* ptch);
 patch* patch_array_at(patch_array* arr, size_t idx);
@@ -97,6 +112,34 @@ struct pkginfo {
     uint64_t cross_compiled;
     union package_version version;
     __attribute__((aligned(1))) uint8_t resv[32 - sizeof (union package_version)];
+    // NOTE: New fields go right before host_triplet_len, so that older records can be upgraded (see state_db.c).
+    // The package's fingerprint (see package_fingerprint) as of the last completed stage.
+    // Zero if the package was built before fingerprints were recorded.
+    uint64_t fingerprint;
+    // The fingerprint of each completed stage (see package_stage_fingerprints), indexed by
+    // the build state that the stage results in, minus one.
+    // Zero if the package was built before per-stage fingerprints were recorded.
+    uint64_t stage_fingerprints[BUILD_STATE_INSTALLED];
+    // The hash of the manifest of the package's output as of its last install (see manifest.h).
+    // Zero if the package was never installed, or was installed before outputs were hashed.
+    uint64_t output_hash;
+    // See package_dependency_output_hash, as of when the package was configured.
+    // Zero if the package was configured before outputs were hashed.
+    uint64_t dependency_output_hash;
+    // How long each stage took the last time it was run, in microseconds, indexed like stage_fingerprints.
+    // Zero if the stage was never run, or was run before durations were recorded.
+    uint64_t stage_durations[BUILD_STATE_INSTALLED];
+    // The resources used by each stage the last time it was run, as reported by wait4, indexed like stage_fingerprints.
+    // Zero if the stage was run before they were recorded.
+    // For the fetch stage, this adds up the processes it ran (e.g., git, tar, and patch), but not the downloads.
+    // The peak memory use (maximum resident set size), in KiB.
+    uint64_t stage_max_rss[BUILD_STATE_INSTALLED];
+    // The user and system CPU time, in microseconds.
+    uint64_t stage_user_time[BUILD_STATE_INSTALLED];
+    uint64_t stage_system_time[BUILD_STATE_INSTALLED];
+    // The amount of blocks read from and written to the file system.
+    uint32_t stage_blocks_in[BUILD_STATE_INSTALLED];
+    uint32_t stage_blocks_out[BUILD_STATE_INSTALLED];
     uint64_t host_triplet_len;
     char host_triplet[]; // the triplet of the host this package is intended to run on.
 };
@@ -112,12 +155,22 @@ typedef struct package {
     const char *name;
     const char* description;
 
+    // NOTE: Only valid after package_load_commands.
     const char* host_provides;
 
     char* bin_package_prefix;
+    // See package_make_staging_directory.
+    char* staging_directory;
 
     struct timeval recipe_mod_time;
 
+    // If non-NULL, a mapping that some of the package's strings point into.
+    void* backing;
+    size_t backing_size;
+
+    // Everything else that belongs to the package (including the package itself) is allocated from here.
+    arena arena;
+
     union {
         struct {
             const char* git_commit;
@@ -132,32 +185,110 @@ typedef struct package {
         SOURCE_TYPE_GIT,
         SOURCE_TYPE_WEB,
     } source_type;
+    // NOTE: Only valid after package_load_commands.
     patch_array patches;
 
     string_array depends;
     string_array build_depends;
 
+    // NOTE: Only valid after package_load_commands.
     command_array build_commands;
     command_array install_commands;
     command_array bootstrap_commands;
     command_array run_commands;
 
+    // Set by whoever parsed the package, loads the fields above that are only
+    // valid after package_load_commands, from lazy_data.
+    int(*load_commands)(struct package* pkg);
+    void* lazy_data;
+    pthread_mutex_t load_lock;
+    atomic_bool commands_loaded;
+    int load_status;
+    // See package_stage_fingerprints, protected by load_lock.
+    uint64_t fingerprint;
+    uint64_t stage_fingerprints[BUILD_STATE_INSTALLED];
+
     union package_version version;
 
+    // The resources that building the package is expected to take, as declared by the recipe.
+    // Zero if the recipe does not declare them.
+    // The peak memory use, in MiB.
+    uint32_t memory;
+    // The amount of CPUs kept busy.
+    uint32_t cpu_weight;
+
     bool host_package : 1;
+    // Set when the recipe is parsed, if its commands substitute ${bin_package_prefix}.
     bool supports_binary_packages : 1;
     bool inhibit_auto_rebuild : 1;
 } package;
+// Returns a zeroed package, allocated from its own arena.
+package* package_alloc();
+// Frees the package, and everything allocated from its arena.
+void package_free(package* pkg);
 char* package_make_bin_prefix(package* pkg);
+// The directory that ${destdir} refers to in the install commands of a target package.
+// Packages are installed there first, and are then merged into destination_directory, so
+// that what a package installed is known without scanning the whole of destination_directory.
+char* package_make_staging_directory(package* pkg);
+// Loads (and substitutes) the patches, host_provides, and the command arrays of pkg,
+// if that was not already done, as they are not needed to query a package's metadata.
+// Thread-safe.
+// Returns non-zero on failure (e.g., a substitution error).
+int package_load_commands(package* pkg);
+// A hash of everything that goes into building the package: the parsed recipe, the contents
+// of its patches, its substituted commands, and the settings that affect the build.
+// Loads the package's commands. Never returns zero.
+uint64_t package_fingerprint(package* pkg);
+// The fingerprint of the inputs of each stage, indexed by the build state that the stage results in, minus one:
+// the source and patches, the bootstrap commands and settings, the build commands, and the install commands.
+// Changing a stage's inputs only invalidates that stage, and the ones after it.
+// out must have room for BUILD_STATE_INSTALLED entries.
+void package_stage_fingerprints(package* pkg, uint64_t* out);
+// A hash of the output hashes of every dependency of the package, as they are currently installed.
+// A package is reconfigured (and rebuilt) when this changes, so that dependants are only rebuilt
+// if the output of one of their dependencies actually changed.
+// Never returns zero.
+uint64_t package_dependency_output_hash(package* pkg);
+// Returns the build state that the package has to be reset to, so that every stage whose inputs
+// changed since it was completed is redone, or info->build_state if nothing changed.
+// This includes the output of the package's dependencies (see package_dependency_output_hash).
+int package_invalidated_state(package* pkg, struct pkginfo* info);
+enum {
+    OUTDATED_REASON_NONE = 0,
+    // The package was built for a different triplet.
+    OUTDATED_REASON_TRIPLET,
+    // The package's build state is past since_state, or the package was never built far enough to tell.
+    OUTDATED_REASON_STAGE,
+    // The recipe's version changed.
+    OUTDATED_REASON_VERSION,
+    // The inputs of a completed stage changed (see package_stage_fingerprints).
+    OUTDATED_REASON_RECIPE,
+    // The output of a dependency changed (see package_dependency_output_hash).
+    OUTDATED_REASON_DEPENDENCY,
+};
+// Returns why the package is outdated, or OUTDATED_REASON_NONE if it is not.
+// If state is not NULL, it is set to the build state that the package has to be reset to.
+// info can be NULL
+int package_outdated_reason(package* pkg, struct pkginfo* info, int since_state, int* state);
 // info can be NULL
 bool package_outdated(package* pkg, struct pkginfo* info, int since_state);
 
+// Packages are parsed once per process, and shared between all callers (and threads).
+// The returned package is owned by the package registry, and must not be freed.
 package* get_package(const char* pkg_name);
 
 int run_command(const char* proc, string_array argv);
+// Like run_command, but the process is started in cwd (if not NULL).
+// The working directory of the calling process is not changed.
+int run_command_in(const char* proc, string_array argv, const char* cwd);
+// Like run_command_in, and if usage is not NULL, it is set to the resources used by the process
+// (and every child process it waited for).
+int run_command_ex(const char* proc, string_array argv, const char* cwd, struct rusage* usage);
 int run_command_supress_output(const char* proc, string_array argv);
 
 // if cb returns non-zero, the function aborts.
-// pkg and info are owned by the callback at time of called,
-// and are to be freed by the callback
+// info is owned by the callback at time of called,
+// and is to be freed by the callback.
+// pkg is owned by the package registry (see get_package).
 void foreach_package(bool installed_only, int(*cb)(package* pkg, struct pkginfo* info, void *userdata), void *userdata);
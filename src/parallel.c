@@ -0,0 +1,58 @@
+/*
+ * src/parallel.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+typedef struct parallel_ctx {
+    size_t cnt;
+    atomic_size_t next;
+    void(*cb)(size_t i, void* udata);
+    void* udata;
+} parallel_ctx;
+
+static void* parallel_worker(void* arg)
+{
+    parallel_ctx* ctx = arg;
+    size_t i = 0;
+    while ((i = atomic_fetch_add(&ctx->next, 1)) < ctx->cnt)
+        ctx->cb(i, ctx->udata);
+    return NULL;
+}
+
+void parallel_for(size_t cnt, void(*cb)(size_t i, void* udata), void* udata)
+{
+    if (!cnt)
+        return;
+    parallel_ctx ctx = {.cnt=cnt, .cb=cb, .udata=udata};
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nThreads = nproc > 0 ? (size_t)nproc : 1;
+    if (nThreads > cnt)
+        nThreads = cnt;
+
+    // The calling thread is a worker as well.
+    pthread_t* threads = nThreads > 1 ? malloc((nThreads-1)*sizeof(pthread_t)) : NULL;
+    size_t nStarted = 0;
+    for (; nStarted < nThreads-1 && threads; nStarted++)
+    {
+        if (pthread_create(&threads[nStarted], NULL, parallel_worker, &ctx) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+    }
+    parallel_worker(&ctx);
+    for (size_t i = 0; i < nStarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
@@ -0,0 +1,13 @@
+/*
+ * src/parallel.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+// Calls cb for every i in [0,cnt), spread across up to one thread per CPU.
+// Returns once every call has returned.
+void parallel_for(size_t cnt, void(*cb)(size_t i, void* udata), void* udata);
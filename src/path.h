@@ -7,6 +7,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 // Final install directory.
 extern const char* destination_directory;
@@ -24,6 +25,8 @@ extern const char* repo_directory;
 extern const char* recipes_directory;
 // Cached info about built packages goes here.
 extern const char* pkg_info_directory;
+// Compiled recipes go here. NULL if the cache is disabled.
+extern const char* recipe_cache_directory;
 // The repository root directory (i.e., the CWD at start)
 extern const char* root_directory;
 
@@ -35,4 +38,6 @@ extern struct config {
 	bool cross_compiling;
 	bool binary_packages_default;
 	const char* host_triplet;
+	// A hash of the environment variables set in settings.json.
+	uint64_t environment_hash;
 } g_config;
@@ -0,0 +1,728 @@
+/*
+ * src/recipe_cache.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+
+#include "recipe_cache.h"
+#include "package.h"
+#include "path.h"
+#include "hash.h"
+#include "parallel.h"
+
+// Format (of both compiled recipes, and the recipe index):
+// struct recipe_cache_header
+// uint32_t words[nWords]
+// char strings[szStrings]
+// Strings are referred to by their offset in the string table, and are NUL-terminated.
+// Bump RECIPE_CACHE_VERSION when changing anything here, or the layout of a package.
+#define RECIPE_CACHE_MAGIC "OBSTRAPC"
+#define RECIPE_INDEX_MAGIC "OBSTRAPI"
+#define RECIPE_CACHE_VERSION 4
+#define RECIPE_CACHE_NULL_STRING UINT32_MAX
+
+struct recipe_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nWords;
+    // For compiled recipes, the hash of the recipe.
+    // For the index, the hash of the recipes directory.
+    uint64_t key;
+    uint64_t settings_hash;
+    uint64_t szStrings;
+};
+
+enum {
+    RECIPE_CACHE_HOST_PACKAGE = (1<<0),
+    RECIPE_CACHE_SUPPORTS_BINARY_PACKAGES = (1<<1),
+    RECIPE_CACHE_INHIBIT_AUTO_REBUILD = (1<<2),
+};
+
+static pthread_once_t settings_hash_once = PTHREAD_ONCE_INIT;
+static uint64_t cached_settings_hash;
+
+// Hashes everything outside of the recipe that can be substituted into it.
+// Environment variables are validated separately (see recipe_cache_load).
+static void compute_settings_hash()
+{
+    uint64_t hash = HASH_INITIAL;
+    hash = hash_string(hash, bootstrap_directory);
+    hash = hash_string(hash, repo_directory);
+    hash = hash_string(hash, destination_directory);
+    hash = hash_string(hash, prefix_directory);
+    hash = hash_string(hash, host_prefix_directory);
+    hash = hash_string(hash, root_directory);
+    hash = hash_string(hash, g_config.target_triplet);
+    hash = hash_string(hash, g_config.host_triplet);
+    hash = hash_u64(hash, g_config.cross_compiling);
+    hash = hash_u64(hash, sysconf(_SC_NPROCESSORS_ONLN));
+    cached_settings_hash = hash;
+}
+
+static uint64_t settings_hash()
+{
+    pthread_once(&settings_hash_once, compute_settings_hash);
+    return cached_settings_hash;
+}
+
+static char* make_cache_path(const char* pkg_name, const char* suffix)
+{
+    size_t len = snprintf(NULL, 0, "%s/%s.bin%s", recipe_cache_directory, pkg_name, suffix);
+    char* path = malloc(len+1);
+    snprintf(path, len+1, "%s/%s.bin%s", recipe_cache_directory, pkg_name, suffix);
+    return path;
+}
+
+typedef struct cache_writer {
+    uint32_t* words;
+    size_t nWords;
+    size_t capWords;
+    char* strings;
+    size_t szStrings;
+    size_t capStrings;
+} cache_writer;
+
+static void write_word(cache_writer* w, uint32_t word)
+{
+    if (w->nWords >= w->capWords)
+    {
+        w->capWords = w->capWords ? w->capWords*2 : 64;
+        w->words = realloc(w->words, w->capWords*sizeof(uint32_t));
+    }
+    w->words[w->nWords++] = word;
+}
+
+static void write_string(cache_writer* w, const char* str)
+{
+    if (!str)
+    {
+        write_word(w, RECIPE_CACHE_NULL_STRING);
+        return;
+    }
+    size_t len = strlen(str);
+    write_word(w, w->szStrings);
+    if (w->szStrings+len+1 > w->capStrings)
+    {
+        size_t cap = w->capStrings ? w->capStrings*2 : 256;
+        while (cap < w->szStrings+len+1)
+            cap *= 2;
+        w->strings = realloc(w->strings, cap);
+        w->capStrings = cap;
+    }
+    memcpy(w->strings + w->szStrings, str, len+1);
+    w->szStrings += len+1;
+}
+
+static void write_string_array(cache_writer* w, const string_array* arr)
+{
+    write_word(w, arr->cnt);
+    for (size_t i = 0; i < arr->cnt; i++)
+        write_string(w, arr->buf[i]);
+}
+
+static void write_command_array(cache_writer* w, const command_array* arr)
+{
+    write_word(w, arr->cnt);
+    for (size_t i = 0; i < arr->cnt; i++)
+        write_string_array(w, &arr->buf[i].argv);
+}
+
+// Writes to a temporary file, then renames it over the old file, so that
+// readers never see a partially written file.
+static bool write_cache_file(const char* path, struct recipe_cache_header* hdr, cache_writer* w)
+{
+    hdr->nWords = w->nWords;
+    hdr->szStrings = w->szStrings;
+
+    size_t len = snprintf(NULL, 0, "%s.XXXXXX", path);
+    char* tmp_path = malloc(len+1);
+    snprintf(tmp_path, len+1, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd == -1)
+    {
+        free(tmp_path);
+        free(w->words);
+        free(w->strings);
+        return false;
+    }
+    fchmod(fd, 0644);
+    FILE* file = fdopen(fd, "w");
+    bool success = file != NULL;
+    if (success)
+    {
+        success = fwrite(hdr, sizeof(*hdr), 1, file) == 1;
+        if (success && w->nWords)
+            success = fwrite(w->words, sizeof(uint32_t), w->nWords, file) == w->nWords;
+        if (success && w->szStrings)
+            success = fwrite(w->strings, 1, w->szStrings, file) == w->szStrings;
+        success = (fclose(file) == 0) && success;
+    }
+    else
+        close(fd);
+    if (success && rename(tmp_path, path) == -1)
+        success = false;
+    if (!success)
+        remove(tmp_path);
+    free(tmp_path);
+    free(w->words);
+    free(w->strings);
+    return success;
+}
+
+void recipe_cache_store(const char* pkg_name, uint64_t recipe_hash, package* pkg, const string_array* env)
+{
+    if (!recipe_cache_directory)
+        return;
+
+    cache_writer w = {};
+    uint32_t flags = 0;
+    if (pkg->host_package)
+        flags |= RECIPE_CACHE_HOST_PACKAGE;
+    if (pkg->supports_binary_packages)
+        flags |= RECIPE_CACHE_SUPPORTS_BINARY_PACKAGES;
+    if (pkg->inhibit_auto_rebuild)
+        flags |= RECIPE_CACHE_INHIBIT_AUTO_REBUILD;
+    write_word(&w, flags);
+    write_word(&w, pkg->version.major | (pkg->version.minor << 8) | (pkg->version.patch << 16));
+    write_word(&w, pkg->memory);
+    write_word(&w, pkg->cpu_weight);
+    write_string(&w, pkg->name);
+    write_string(&w, pkg->description);
+    write_word(&w, pkg->source_type);
+    switch (pkg->source_type)
+    {
+        case SOURCE_TYPE_GIT:
+            write_string(&w, pkg->source.git.git_url);
+            write_string(&w, pkg->source.git.git_commit);
+            break;
+        case SOURCE_TYPE_WEB:
+            write_string(&w, pkg->source.web.url);
+            break;
+        default:
+            break;
+    }
+    write_string_array(&w, &pkg->depends);
+    write_string_array(&w, &pkg->build_depends);
+    write_string_array(&w, env);
+    // Everything after this point is only read by package_load_commands.
+    write_string(&w, pkg->host_provides);
+    write_word(&w, pkg->patches.cnt);
+    for (size_t i = 0; i < pkg->patches.cnt; i++)
+    {
+        write_string(&w, pkg->patches.buf[i].patch);
+        write_string(&w, pkg->patches.buf[i].modifies);
+        write_word(&w, pkg->patches.buf[i].delete_file);
+    }
+    write_command_array(&w, &pkg->bootstrap_commands);
+    write_command_array(&w, &pkg->build_commands);
+    write_command_array(&w, &pkg->install_commands);
+    write_command_array(&w, &pkg->run_commands);
+
+    struct recipe_cache_header hdr = {
+        .magic=RECIPE_CACHE_MAGIC,
+        .version=RECIPE_CACHE_VERSION,
+        .key=recipe_hash,
+        .settings_hash=settings_hash(),
+    };
+    char* path = make_cache_path(pkg_name, "");
+    write_cache_file(path, &hdr, &w);
+    free(path);
+}
+
+typedef struct cache_reader {
+    const uint32_t* words;
+    size_t nWords;
+    size_t pos;
+    const char* strings;
+    size_t szStrings;
+    bool error;
+} cache_reader;
+
+static uint32_t read_word(cache_reader* r)
+{
+    if (r->pos >= r->nWords)
+    {
+        r->error = true;
+        return 0;
+    }
+    return r->words[r->pos++];
+}
+
+static char* read_string(cache_reader* r)
+{
+    uint32_t offset = read_word(r);
+    if (offset == RECIPE_CACHE_NULL_STRING)
+        return NULL;
+    if (offset >= r->szStrings)
+    {
+        r->error = true;
+        return NULL;
+    }
+    return (char*)&r->strings[offset];
+}
+
+// Bounds an element count by the amount of words left, so that
+// a corrupt entry cannot make us allocate an absurd amount of memory.
+static size_t read_count(cache_reader* r)
+{
+    uint32_t cnt = read_word(r);
+    if (cnt > (r->nWords - r->pos))
+    {
+        r->error = true;
+        return 0;
+    }
+    return cnt;
+}
+
+// Strings are not copied, and point into the mapping.
+static void read_string_array(cache_reader* r, string_array* arr)
+{
+    size_t cnt = read_count(r);
+    if (!cnt)
+        return;
+    arr->buf = arr->arena ? arena_alloc(arr->arena, cnt*sizeof(char*)) : malloc(cnt*sizeof(char*));
+    arr->cap = cnt;
+    for (arr->cnt = 0; arr->cnt < cnt; arr->cnt++)
+        arr->buf[arr->cnt] = read_string(r);
+}
+
+static void read_command_array(cache_reader* r, command_array* arr)
+{
+    size_t cnt = read_count(r);
+    if (!cnt)
+        return;
+    arr->buf = arena_alloc(arr->arena, cnt*sizeof(command));
+    memset(arr->buf, 0, cnt*sizeof(command));
+    arr->cap = cnt;
+    for (arr->cnt = 0; arr->cnt < cnt && !r->error; arr->cnt++)
+    {
+        command* cmd = &arr->buf[arr->cnt];
+        cmd->argv.arena = arr->arena;
+        read_string_array(r, &cmd->argv);
+        cmd->proc = string_array_at(&cmd->argv, 0);
+        if (!cmd->proc)
+            r->error = true;
+    }
+}
+
+// Maps a file written by write_cache_file, and validates its header.
+// Returns NULL if the file is missing, or invalid.
+static const struct recipe_cache_header* map_cache_file(const char* path, const char* magic, size_t* size, cache_reader* r)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st = {};
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct recipe_cache_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const struct recipe_cache_header* hdr = mapping;
+    if (memcmp(hdr->magic, magic, sizeof(hdr->magic)) != 0 ||
+        hdr->version != RECIPE_CACHE_VERSION ||
+        sizeof(*hdr) + hdr->nWords*sizeof(uint32_t) + hdr->szStrings != (size_t)st.st_size)
+    {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    *r = (cache_reader){
+        .words=(const uint32_t*)(hdr+1),
+        .nWords=hdr->nWords,
+        .strings=(const char*)(hdr+1) + hdr->nWords*sizeof(uint32_t),
+        .szStrings=hdr->szStrings,
+    };
+    if (r->szStrings && r->strings[r->szStrings-1] != 0)
+    {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return hdr;
+}
+
+static int load_cached_commands(package* pkg)
+{
+    cache_reader* r = pkg->lazy_data;
+    pkg->host_provides = read_string(r);
+    size_t nPatches = read_count(r);
+    if (nPatches)
+    {
+        pkg->patches.buf = arena_alloc(&pkg->arena, nPatches*sizeof(patch));
+        pkg->patches.cap = nPatches;
+    }
+    for (pkg->patches.cnt = 0; pkg->patches.cnt < nPatches; pkg->patches.cnt++)
+    {
+        patch* ptch = &pkg->patches.buf[pkg->patches.cnt];
+        ptch->patch = read_string(r);
+        ptch->modifies = read_string(r);
+        ptch->delete_file = !!read_word(r);
+    }
+    read_command_array(r, &pkg->bootstrap_commands);
+    read_command_array(r, &pkg->build_commands);
+    read_command_array(r, &pkg->install_commands);
+    read_command_array(r, &pkg->run_commands);
+    if (r->error)
+    {
+        printf("%s: Corrupt recipe cache entry for package %s. Run %s clean to remove the cache.\n", g_argv[0], pkg->name, g_argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+package* recipe_cache_load(const char* pkg_name, uint64_t recipe_hash)
+{
+    if (!recipe_cache_directory)
+        return NULL;
+
+    char* path = make_cache_path(pkg_name, "");
+    size_t size = 0;
+    cache_reader r = {};
+    const struct recipe_cache_header* hdr = map_cache_file(path, RECIPE_CACHE_MAGIC, &size, &r);
+    free(path);
+    if (!hdr)
+        return NULL;
+    void* mapping = (void*)hdr;
+    if (hdr->key != recipe_hash || hdr->settings_hash != settings_hash())
+    {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    package* pkg = package_alloc();
+    pkg->backing = mapping;
+    pkg->backing_size = size;
+
+    uint32_t flags = read_word(&r);
+    pkg->host_package = !!(flags & RECIPE_CACHE_HOST_PACKAGE);
+    pkg->supports_binary_packages = !!(flags & RECIPE_CACHE_SUPPORTS_BINARY_PACKAGES);
+    pkg->inhibit_auto_rebuild = !!(flags & RECIPE_CACHE_INHIBIT_AUTO_REBUILD);
+    uint32_t version = read_word(&r);
+    pkg->version.major = version & 0xff;
+    pkg->version.minor = (version >> 8) & 0xff;
+    pkg->version.patch = (version >> 16) & 0xff;
+    pkg->memory = read_word(&r);
+    pkg->cpu_weight = read_word(&r);
+    pkg->name = read_string(&r);
+    pkg->description = read_string(&r);
+    pkg->source_type = read_word(&r);
+    switch (pkg->source_type)
+    {
+        case SOURCE_TYPE_GIT:
+            pkg->source.git.git_url = read_string(&r);
+            pkg->source.git.git_commit = read_string(&r);
+            break;
+        case SOURCE_TYPE_WEB:
+            pkg->source.web.url = read_string(&r);
+            break;
+        case SOURCE_TYPE_SOURCELESS:
+            break;
+        default:
+            r.error = true;
+            break;
+    }
+    read_string_array(&r, &pkg->depends);
+    read_string_array(&r, &pkg->build_depends);
+
+    // Make sure that the environment variables substituted into
+    // the recipe have not changed since this entry was written.
+    string_array env = {};
+    read_string_array(&r, &env);
+    if (env.cnt % 2)
+        r.error = true;
+    for (size_t i = 0; i + 1 < env.cnt && !r.error; i += 2)
+    {
+        const char* val = env.buf[i] ? getenv(env.buf[i]) : NULL;
+        if (!val || !env.buf[i+1] || strcmp(val, env.buf[i+1]) != 0)
+            r.error = true;
+    }
+    free(env.buf);
+
+    if (r.error || !pkg->name)
+    {
+        package_free(pkg);
+        return NULL;
+    }
+
+    // The rest of the entry is read by package_load_commands.
+    cache_reader* lazy = arena_alloc(&pkg->arena, sizeof(cache_reader));
+    *lazy = r;
+    pkg->lazy_data = lazy;
+    pkg->load_commands = load_cached_commands;
+
+    package_make_bin_prefix(pkg);
+    return pkg;
+}
+
+static int cmp_index_entries(const void* lhs_, const void* rhs_)
+{
+    const recipe_index_entry* lhs = lhs_;
+    const recipe_index_entry* rhs = rhs_;
+    return strcmp(lhs->name, rhs->name);
+}
+
+const recipe_index_entry* recipe_index_find(const recipe_index* index, const char* name)
+{
+    if (!index->cnt)
+        return NULL;
+    recipe_index_entry what = {.name=name};
+    return bsearch(&what, index->entries, index->cnt, sizeof(recipe_index_entry), cmp_index_entries);
+}
+
+static char* make_index_path()
+{
+    size_t len = snprintf(NULL, 0, "%s/index.bin", recipe_cache_directory);
+    char* path = malloc(len+1);
+    snprintf(path, len+1, "%s/index.bin", recipe_cache_directory);
+    return path;
+}
+
+// Reads the on-disk index into index. The entries' strings point into the mapping,
+// which is kept for the lifetime of the process.
+static void read_index(recipe_index* index)
+{
+    if (!recipe_cache_directory)
+        return;
+    char* path = make_index_path();
+    size_t size = 0;
+    cache_reader r = {};
+    const struct recipe_cache_header* hdr = map_cache_file(path, RECIPE_INDEX_MAGIC, &size, &r);
+    free(path);
+    if (!hdr)
+        return;
+    if (hdr->key != hash_string(HASH_INITIAL, recipes_directory) || hdr->settings_hash != settings_hash())
+    {
+        munmap((void*)hdr, size);
+        return;
+    }
+
+    size_t cnt = read_count(&r);
+    recipe_index_entry* entries = cnt ? calloc(cnt, sizeof(recipe_index_entry)) : NULL;
+    for (size_t i = 0; i < cnt && !r.error; i++)
+    {
+        recipe_index_entry* ent = &entries[i];
+        ent->name = read_string(&r);
+        uint64_t sec = read_word(&r);
+        sec |= (uint64_t)read_word(&r) << 32;
+        ent->recipe_mtim.tv_sec = sec;
+        ent->recipe_mtim.tv_nsec = read_word(&r);
+        uint64_t recipe_size = read_word(&r);
+        recipe_size |= (uint64_t)read_word(&r) << 32;
+        ent->recipe_size = recipe_size;
+        uint32_t version = read_word(&r);
+        ent->version.major = version & 0xff;
+        ent->version.minor = (version >> 8) & 0xff;
+        ent->version.patch = (version >> 16) & 0xff;
+        uint32_t flags = read_word(&r);
+        ent->host_package = !!(flags & RECIPE_CACHE_HOST_PACKAGE);
+        ent->inhibit_auto_rebuild = !!(flags & RECIPE_CACHE_INHIBIT_AUTO_REBUILD);
+        read_string_array(&r, &ent->depends);
+        read_string_array(&r, &ent->build_depends);
+        if (!ent->name)
+            r.error = true;
+    }
+    if (r.error)
+    {
+        // NOTE: The arrays are leaked, this is not expected to happen often.
+        free(entries);
+        munmap((void*)hdr, size);
+        return;
+    }
+    index->entries = entries;
+    index->cnt = cnt;
+}
+
+static void write_index(const recipe_index* index)
+{
+    if (!recipe_cache_directory)
+        return;
+    cache_writer w = {};
+    write_word(&w, index->cnt);
+    for (size_t i = 0; i < index->cnt; i++)
+    {
+        const recipe_index_entry* ent = &index->entries[i];
+        write_string(&w, ent->name);
+        write_word(&w, (uint64_t)ent->recipe_mtim.tv_sec & 0xffffffff);
+        write_word(&w, (uint64_t)ent->recipe_mtim.tv_sec >> 32);
+        write_word(&w, ent->recipe_mtim.tv_nsec);
+        write_word(&w, (uint64_t)ent->recipe_size & 0xffffffff);
+        write_word(&w, (uint64_t)ent->recipe_size >> 32);
+        write_word(&w, ent->version.major | (ent->version.minor << 8) | (ent->version.patch << 16));
+        uint32_t flags = 0;
+        if (ent->host_package)
+            flags |= RECIPE_CACHE_HOST_PACKAGE;
+        if (ent->inhibit_auto_rebuild)
+            flags |= RECIPE_CACHE_INHIBIT_AUTO_REBUILD;
+        write_word(&w, flags);
+        write_string_array(&w, &ent->depends);
+        write_string_array(&w, &ent->build_depends);
+    }
+    struct recipe_cache_header hdr = {
+        .magic=RECIPE_INDEX_MAGIC,
+        .version=RECIPE_CACHE_VERSION,
+        .key=hash_string(HASH_INITIAL, recipes_directory),
+        .settings_hash=settings_hash(),
+    };
+    char* path = make_index_path();
+    write_cache_file(path, &hdr, &w);
+    free(path);
+}
+
+static recipe_index current_index;
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+typedef struct index_load_ctx {
+    const recipe_index* index;
+    // Entries of which the recipe must be (re)loaded.
+    const size_t* entries;
+    package** pkgs;
+} index_load_ctx;
+
+static void load_index_entry(size_t i, void* udata)
+{
+    index_load_ctx* ctx = udata;
+    ctx->pkgs[i] = get_package(ctx->index->entries[ctx->entries[i]].name);
+}
+
+static void update_index()
+{
+    recipe_index old = {};
+    read_index(&old);
+    bool changed = false;
+
+    DIR* dir = opendir(recipes_directory);
+    if (!dir)
+    {
+        perror("opendir");
+        current_index = old;
+        return;
+    }
+    struct dirent* ent = NULL;
+    size_t* stale_entries = NULL;
+    size_t nStale = 0;
+    size_t capacity = old.cnt;
+    recipe_index* index = &current_index;
+    index->entries = capacity ? malloc(capacity*sizeof(recipe_index_entry)) : NULL;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        const char* filename = ent->d_name;
+        size_t len = strlen(filename);
+        if (len <= 5 || strcmp(filename + len - 5, ".json") != 0)
+            continue;
+        size_t len_recipe_name = len - 5;
+        char* pkg_name = memcpy(malloc(len_recipe_name+1), filename, len_recipe_name);
+        pkg_name[len_recipe_name] = 0;
+
+        size_t pathlen = snprintf(NULL, 0, "%s/%s", recipes_directory, filename);
+        char* path = malloc(pathlen+1);
+        snprintf(path, pathlen+1, "%s/%s", recipes_directory, filename);
+        struct stat st = {};
+        int ec = stat(path, &st);
+        free(path);
+        if (ec == -1 || !S_ISREG(st.st_mode))
+        {
+            free(pkg_name);
+            continue;
+        }
+
+        if (index->cnt == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            index->entries = realloc(index->entries, capacity*sizeof(recipe_index_entry));
+        }
+        recipe_index_entry* new_ent = &index->entries[index->cnt];
+
+        const recipe_index_entry* old_ent = recipe_index_find(&old, pkg_name);
+        if (old_ent &&
+            old_ent->recipe_mtim.tv_sec == st.st_mtim.tv_sec &&
+            old_ent->recipe_mtim.tv_nsec == st.st_mtim.tv_nsec &&
+            old_ent->recipe_size == st.st_size)
+        {
+            *new_ent = *old_ent;
+            index->cnt++;
+            free(pkg_name);
+            continue;
+        }
+
+        // Filled in once every stale recipe has been loaded.
+        *new_ent = (recipe_index_entry){
+            .name=pkg_name,
+            .recipe_mtim=st.st_mtim,
+            .recipe_size=st.st_size,
+        };
+        if (!(nStale % 64))
+            stale_entries = realloc(stale_entries, (nStale+64)*sizeof(size_t));
+        stale_entries[nStale++] = index->cnt;
+        index->cnt++;
+    }
+    closedir(dir);
+
+    // Recipes are loaded in parallel, as this is slow on a cold cache.
+    package** pkgs = nStale ? calloc(nStale, sizeof(package*)) : NULL;
+    index_load_ctx ctx = {.index=index, .entries=stale_entries, .pkgs=pkgs};
+    parallel_for(nStale, load_index_entry, &ctx);
+    for (size_t i = 0; i < nStale; i++)
+    {
+        recipe_index_entry* new_ent = &index->entries[stale_entries[i]];
+        package* pkg = pkgs[i];
+        changed = true;
+        if (!pkg)
+        {
+            printf("Warning: Could not get package '%s'\n", new_ent->name);
+            free((char*)new_ent->name);
+            new_ent->name = NULL;
+            continue;
+        }
+        new_ent->version = pkg->version;
+        new_ent->depends = pkg->depends;
+        new_ent->build_depends = pkg->build_depends;
+        new_ent->host_package = pkg->host_package;
+        new_ent->inhibit_auto_rebuild = pkg->inhibit_auto_rebuild;
+    }
+    free(pkgs);
+    free(stale_entries);
+
+    // Drop the entries of recipes that could not be loaded.
+    size_t nEntries = 0;
+    for (size_t i = 0; i < index->cnt; i++)
+        if (index->entries[i].name)
+            index->entries[nEntries++] = index->entries[i];
+    index->cnt = nEntries;
+
+    // Recipes were removed.
+    if (index->cnt != old.cnt)
+        changed = true;
+
+    qsort(index->entries, index->cnt, sizeof(recipe_index_entry), cmp_index_entries);
+    if (changed)
+        write_index(index);
+    free(old.entries);
+}
+
+const recipe_index* get_recipe_index()
+{
+    pthread_once(&index_once, update_index);
+    return &current_index;
+}
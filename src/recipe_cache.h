@@ -0,0 +1,53 @@
+/*
+ * src/recipe_cache.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "package.h"
+
+// Compiled recipes are stored in recipe_cache_directory, one file per recipe.
+// An entry is only valid if both the recipe's content hash, and the settings that
+// affect substitution, are the same as when the entry was written.
+// Strings in a package loaded from the cache point into a read-only mapping of the entry.
+// Packages loaded from the cache only read the commands part of the entry in package_load_commands.
+
+// Returns NULL on a cache miss.
+package* recipe_cache_load(const char* pkg_name, uint64_t recipe_hash);
+// env contains pairs of environment variables (name, value) that were substituted into the recipe.
+// NOTE: pkg's commands must have been loaded (see package_load_commands).
+void recipe_cache_store(const char* pkg_name, uint64_t recipe_hash, package* pkg, const string_array* env);
+
+// The recipe index holds the metadata of every recipe in the recipes directory,
+// so that commands that only need names and dependencies do not have to load every recipe.
+// It is stored in recipe_cache_directory, and entries are refreshed whenever the recipe's
+// modification time or size changes.
+typedef struct recipe_index_entry {
+    // The recipe's file name, without .json
+    const char* name;
+    union package_version version;
+    string_array depends;
+    string_array build_depends;
+    struct timespec recipe_mtim;
+    off_t recipe_size;
+    bool host_package : 1;
+    bool inhibit_auto_rebuild : 1;
+} recipe_index_entry;
+
+typedef struct recipe_index {
+    // Sorted by name.
+    recipe_index_entry* entries;
+    size_t cnt;
+} recipe_index;
+
+// Returns the index, bringing it up to date on the first call.
+const recipe_index* get_recipe_index();
+// Returns NULL if the recipe does not exist.
+const recipe_index_entry* recipe_index_find(const recipe_index* index, const char* name);
@@ -0,0 +1,604 @@
+/*
+ * src/state_db.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "state_db.h"
+#include "package.h"
+#include "path.h"
+#include "tree.h"
+#include "hash.h"
+
+// Format of state.db:
+// struct state_db_header, padded to STATE_DB_RECORD_SIZE
+// state_record records[capacity]
+// Records are never moved or removed, so a record's index (its ID) stays the same for
+// as long as the database exists.
+// Format of state.wal:
+// struct wal_entry entries[]
+// Both records and log entries are checksummed, so that a torn write (e.g., if the
+// process was killed halfway through one) is detected, and the entry is ignored.
+// Bump STATE_DB_VERSION when changing anything here, or the layout of struct pkginfo.
+// Databases of the previous version then need to be upgraded when opened (see upgrade_record).
+#define STATE_DB_MAGIC "OBSTRAPS"
+#define STATE_DB_VERSION 3
+// pkginfo_<name>.bin files hold a struct pkginfo with the layout of this version.
+#define PKGINFO_FILE_VERSION 2
+#define STATE_DB_RECORD_SIZE 512
+#define STATE_DB_NAME_MAX 128
+#define STATE_DB_INITIAL_CAPACITY 64
+#define STATE_WAL_ENTRY_MAGIC 0x4c415753 /* SWAL */
+// The amount of entries in the log after which it is applied to the database.
+#define STATE_WAL_MAX_ENTRIES 64
+
+struct state_db_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nRecords;
+    uint32_t capacity;
+};
+
+typedef struct state_record {
+    // NUL-terminated.
+    char name[STATE_DB_NAME_MAX];
+    // sizeof(struct pkginfo) + host_triplet_len
+    uint32_t info_size;
+    // See record_checksum
+    uint32_t checksum;
+    // A struct pkginfo.
+    _Alignas(8) char info[STATE_DB_RECORD_SIZE - STATE_DB_NAME_MAX - 8];
+} state_record;
+static_assert(sizeof(state_record) == STATE_DB_RECORD_SIZE, "Invalid size of state_record");
+static_assert(sizeof(struct state_db_header) <= STATE_DB_RECORD_SIZE, "Invalid size of state_db_header");
+
+struct wal_entry {
+    uint32_t magic;
+    uint32_t id;
+    // See wal_entry_checksum
+    uint64_t checksum;
+    state_record record;
+};
+
+static uint32_t record_checksum(const state_record* rec)
+{
+    uint64_t hash = HASH_INITIAL;
+    hash = hash_buffer_ex(hash, rec->name, sizeof(rec->name));
+    hash = hash_u64(hash, rec->info_size);
+    hash = hash_buffer_ex(hash, rec->info, sizeof(rec->info));
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static uint64_t wal_entry_checksum(const struct wal_entry* ent)
+{
+    uint64_t hash = hash_u64(HASH_INITIAL, ent->id);
+    return hash_buffer_ex(hash, &ent->record, sizeof(ent->record));
+}
+
+// The offset of host_triplet_len in struct pkginfo, by version.
+// New fields are always added right before host_triplet_len, so a record from an
+// older version is upgraded by moving the triplet up, and zeroing the new fields.
+static const size_t triplet_len_offsets[] = {
+    [PKGINFO_FILE_VERSION] = 96,
+    [STATE_DB_VERSION] = offsetof(struct pkginfo, host_triplet_len),
+};
+static_assert(sizeof(triplet_len_offsets)/sizeof(*triplet_len_offsets) == STATE_DB_VERSION+1, "Missing offset of host_triplet_len for the current version");
+
+static bool upgrade_record(state_record* rec, uint32_t from_version)
+{
+    size_t old_off = triplet_len_offsets[from_version];
+    size_t new_off = triplet_len_offsets[STATE_DB_VERSION];
+    if (rec->info_size < old_off + sizeof(uint64_t) || rec->info_size - old_off + new_off > sizeof(rec->info))
+        return false;
+    memmove(rec->info + new_off, rec->info + old_off, rec->info_size - old_off);
+    memset(rec->info + old_off, 0, new_off - old_off);
+    rec->info_size += new_off - old_off;
+    rec->checksum = record_checksum(rec);
+    return true;
+}
+
+// Maps package names to record IDs.
+typedef struct record_node {
+    char* name;
+    uint32_t id;
+    RB_ENTRY(record_node) node;
+} record_node;
+
+typedef RB_HEAD(record_tree, record_node) record_tree;
+
+static int cmp_record_nodes(record_node* lhs, record_node* rhs)
+{
+    return strcmp(lhs->name, rhs->name);
+}
+
+RB_GENERATE_STATIC(record_tree, record_node, node, cmp_record_nodes);
+
+// Everything below is protected by db_lock.
+// Other processes are kept out with flock() on the database, while it is being modified.
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+static int db_fd = -1;
+static int wal_fd = -1;
+static char* db_map;
+static size_t db_map_size;
+static size_t nWalEntries;
+// Group commit of the log; see state_db_sync.
+// The amount of entries appended to the log, and how many of those are known to be on disk.
+static uint64_t wal_appended;
+static uint64_t wal_synced;
+static bool wal_syncing;
+static pthread_cond_t wal_synced_cond = PTHREAD_COND_INITIALIZER;
+// The amount of records in records.
+static uint32_t nIndexed;
+static record_tree records = RB_INITIALIZER(&records);
+
+static struct state_db_header* db_header()
+{
+    return (struct state_db_header*)db_map;
+}
+
+static state_record* db_record(uint32_t id)
+{
+    return (state_record*)(db_map + (size_t)STATE_DB_RECORD_SIZE*(id+1));
+}
+
+static char* db_path(const char* file)
+{
+    size_t pathlen = snprintf(NULL, 0, "%s/%s", pkg_info_directory, file);
+    char* path = malloc(pathlen+1);
+    snprintf(path, pathlen+1, "%s/%s", pkg_info_directory, file);
+    return path;
+}
+
+// Maps the whole file, remapping it if it has grown since it was last mapped,
+// possibly by another process.
+static bool map_db()
+{
+    struct stat st = {};
+    if (fstat(db_fd, &st) == -1)
+    {
+        perror("fstat");
+        return false;
+    }
+    if ((size_t)st.st_size <= db_map_size)
+        return true;
+    if (db_map)
+        munmap(db_map, db_map_size);
+    db_map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, db_fd, 0);
+    if (db_map == MAP_FAILED)
+    {
+        perror("mmap");
+        db_map = NULL;
+        db_map_size = 0;
+        return false;
+    }
+    db_map_size = st.st_size;
+    return true;
+}
+
+static bool grow_db(uint32_t min_capacity)
+{
+    uint32_t capacity = db_header()->capacity;
+    while (capacity < min_capacity)
+        capacity *= 2;
+    if (ftruncate(db_fd, (off_t)STATE_DB_RECORD_SIZE*(capacity+1)) == -1)
+    {
+        perror("ftruncate");
+        return false;
+    }
+    if (!map_db())
+        return false;
+    db_header()->capacity = capacity;
+    return true;
+}
+
+static bool apply_record(uint32_t id, const state_record* rec)
+{
+    if (id >= db_header()->capacity && !grow_db(id+1))
+        return false;
+    memcpy(db_record(id), rec, sizeof(*rec));
+    if (id >= db_header()->nRecords)
+        db_header()->nRecords = id+1;
+    return true;
+}
+
+// Adds records written since the last call, possibly by another process, to the tree.
+static void index_records()
+{
+    if (db_header()->nRecords > db_header()->capacity || !map_db())
+        return;
+    for (; nIndexed < db_header()->nRecords; nIndexed++)
+    {
+        state_record* rec = db_record(nIndexed);
+        rec->name[STATE_DB_NAME_MAX-1] = 0;
+        record_node* node = calloc(1, sizeof(record_node));
+        assert(node);
+        node->name = strdup(rec->name);
+        node->id = nIndexed;
+        if (RB_INSERT(record_tree, &records, node))
+        {
+            // Duplicate, use the first record.
+            free(node->name);
+            free(node);
+        }
+    }
+}
+
+static uint32_t find_record(const char* pkg_name)
+{
+    record_node what = {.name=(char*)pkg_name};
+    record_node* found = RB_FIND(record_tree, &records, &what);
+    if (!found && nIndexed != db_header()->nRecords)
+    {
+        index_records();
+        found = RB_FIND(record_tree, &records, &what);
+    }
+    return found ? found->id : UINT32_MAX;
+}
+
+// Writes the database back to disk, and empties the log.
+// The caller must hold the lock on the database.
+static void checkpoint()
+{
+    if (msync(db_map, db_map_size, MS_SYNC) == -1)
+    {
+        perror("msync");
+        return;
+    }
+    if (ftruncate(wal_fd, 0) == -1)
+        perror("ftruncate");
+    nWalEntries = 0;
+    wal_synced = wal_appended;
+}
+
+static void replay_wal()
+{
+    struct stat st = {};
+    if (fstat(wal_fd, &st) == -1 || st.st_size == 0)
+        return;
+    char* buf = malloc(st.st_size);
+    size_t len = 0;
+    ssize_t ret = 0;
+    while (len < (size_t)st.st_size && (ret = pread(wal_fd, buf + len, st.st_size - len, len)) > 0)
+        len += ret;
+    size_t nApplied = 0, nSkipped = 0;
+    // Entries are searched for byte by byte, so that a torn entry in the middle of
+    // the log (written by a process that was killed) does not hide the ones after it.
+    size_t off = 0;
+    while (off + sizeof(struct wal_entry) <= len)
+    {
+        struct wal_entry ent = {};
+        memcpy(&ent, buf + off, sizeof(ent));
+        if (ent.magic != STATE_WAL_ENTRY_MAGIC || ent.checksum != wal_entry_checksum(&ent))
+        {
+            if (ent.magic == STATE_WAL_ENTRY_MAGIC)
+                nSkipped++;
+            off++;
+            continue;
+        }
+        if (!apply_record(ent.id, &ent.record))
+            break;
+        nApplied++;
+        off += sizeof(ent);
+    }
+    free(buf);
+    if (nSkipped || off < len)
+        fprintf(stderr, "%s: Ignoring torn entries in the build state log\n", g_argv[0]);
+#ifndef NDEBUG
+    if (nApplied)
+        printf("Replayed %zu entries from the build state log\n", nApplied);
+#endif
+}
+
+// Moves every pkginfo_<name>.bin file into the database, which must be empty.
+static void migrate_pkginfo_files()
+{
+    DIR* dir = opendir(pkg_info_directory);
+    if (!dir)
+        return;
+    string_array migrated = {};
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir)))
+    {
+        size_t len = strlen(ent->d_name);
+        if (strncmp(ent->d_name, "pkginfo_", 8) != 0 || len <= 12 || strcmp(ent->d_name + len - 4, ".bin") != 0)
+            continue;
+        size_t name_len = len - 12;
+        if (name_len >= STATE_DB_NAME_MAX)
+            continue;
+        char* path = db_path(ent->d_name);
+        FILE* file = fopen(path, "r");
+        if (!file)
+        {
+            free(path);
+            continue;
+        }
+        state_record rec = {};
+        memcpy(rec.name, ent->d_name + 8, name_len);
+        size_t nRead = fread(rec.info, 1, sizeof(rec.info), file);
+        bool eof = fgetc(file) == EOF;
+        fclose(file);
+        const size_t triplet_len_offset = triplet_len_offsets[PKGINFO_FILE_VERSION];
+        uint64_t triplet_len = 0;
+        if (nRead >= triplet_len_offset + sizeof(triplet_len))
+            memcpy(&triplet_len, rec.info + triplet_len_offset, sizeof(triplet_len));
+        rec.info_size = nRead;
+        if (!eof || nRead < triplet_len_offset + sizeof(triplet_len) ||
+            nRead != triplet_len_offset + sizeof(triplet_len) + triplet_len ||
+            !upgrade_record(&rec, PKGINFO_FILE_VERSION))
+        {
+            fprintf(stderr, "%s: Invalid or corrupt package info for package %s, ignoring.\n", g_argv[0], rec.name);
+            free(path);
+            continue;
+        }
+        if (!apply_record(db_header()->nRecords, &rec))
+        {
+            free(path);
+            break;
+        }
+        string_array_append(&migrated, path);
+        free(path);
+    }
+    closedir(dir);
+    if (!migrated.cnt)
+        return;
+    // Only remove the old files once the records are on disk.
+    checkpoint();
+    for (size_t i = 0; i < migrated.cnt; i++)
+        unlink(migrated.buf[i]);
+    fprintf(stderr, "Migrated the package info of %zu package(s) to %s/state.db\n", migrated.cnt, pkg_info_directory);
+    string_array_free(&migrated);
+}
+
+static void close_db_locked()
+{
+    if (db_fd == -1)
+        return;
+    flock(db_fd, LOCK_EX);
+    if (nWalEntries)
+        checkpoint();
+    flock(db_fd, LOCK_UN);
+    munmap(db_map, db_map_size);
+    db_map = NULL;
+    db_map_size = 0;
+    close(db_fd);
+    close(wal_fd);
+    db_fd = -1;
+    wal_fd = -1;
+    record_node *node = NULL, *next = NULL;
+    RB_FOREACH_SAFE(node, record_tree, &records, next)
+    {
+        RB_REMOVE(record_tree, &records, node);
+        free(node->name);
+        free(node);
+    }
+    nIndexed = 0;
+}
+
+void state_db_close()
+{
+    pthread_mutex_lock(&db_lock);
+    close_db_locked();
+    pthread_mutex_unlock(&db_lock);
+}
+
+// The caller must hold db_lock.
+static bool open_db()
+{
+    if (db_fd != -1)
+        return true;
+
+    char* path = db_path("state.db");
+    db_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    free(path);
+    if (db_fd == -1)
+    {
+        // pkg_info_directory does not exist until setup-env is run.
+        if (errno != ENOENT)
+            perror("open");
+        return false;
+    }
+    path = db_path("state.wal");
+    wal_fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    free(path);
+    if (wal_fd == -1)
+    {
+        perror("open");
+        close(db_fd);
+        db_fd = -1;
+        return false;
+    }
+
+    flock(db_fd, LOCK_EX);
+    struct stat st = {};
+    fstat(db_fd, &st);
+    bool created = st.st_size == 0;
+    bool valid = true;
+    if (created)
+    {
+        if (ftruncate(db_fd, (off_t)STATE_DB_RECORD_SIZE*(STATE_DB_INITIAL_CAPACITY+1)) == -1)
+        {
+            perror("ftruncate");
+            valid = false;
+        }
+        else if ((valid = map_db()))
+        {
+            memcpy(db_header()->magic, STATE_DB_MAGIC, 8);
+            db_header()->version = STATE_DB_VERSION;
+            db_header()->record_size = STATE_DB_RECORD_SIZE;
+            db_header()->capacity = STATE_DB_INITIAL_CAPACITY;
+        }
+    }
+    else if ((size_t)st.st_size < STATE_DB_RECORD_SIZE || !map_db())
+        valid = false;
+    if (valid && !created)
+        valid = memcmp(db_header()->magic, STATE_DB_MAGIC, 8) == 0 &&
+                db_header()->version == STATE_DB_VERSION &&
+                db_header()->record_size == STATE_DB_RECORD_SIZE &&
+                db_header()->nRecords <= db_header()->capacity &&
+                db_map_size >= (size_t)STATE_DB_RECORD_SIZE*(db_header()->capacity+1);
+    if (!valid)
+    {
+        fprintf(stderr, "%s: Invalid or corrupt build state database %s/state.db. Run %s clean\n", g_argv[0], pkg_info_directory, g_argv[0]);
+        flock(db_fd, LOCK_UN);
+        if (db_map)
+            munmap(db_map, db_map_size);
+        db_map = NULL;
+        db_map_size = 0;
+        close(db_fd);
+        close(wal_fd);
+        db_fd = -1;
+        wal_fd = -1;
+        return false;
+    }
+
+    // A previous run might not have checkpointed.
+    replay_wal();
+    checkpoint();
+    if (created)
+        migrate_pkginfo_files();
+    index_records();
+    flock(db_fd, LOCK_UN);
+    return true;
+}
+
+struct pkginfo* state_db_read(const char* pkg_name)
+{
+    pthread_mutex_lock(&db_lock);
+    if (!open_db())
+    {
+        pthread_mutex_unlock(&db_lock);
+        return NULL;
+    }
+    uint32_t id = find_record(pkg_name);
+    if (id == UINT32_MAX)
+    {
+        pthread_mutex_unlock(&db_lock);
+        return NULL;
+    }
+    const state_record* rec = db_record(id);
+    const struct pkginfo* rec_info = (struct pkginfo*)rec->info;
+    if (rec->checksum != record_checksum(rec) ||
+        rec->info_size < sizeof(struct pkginfo) || rec->info_size > sizeof(rec->info) ||
+        rec->info_size != sizeof(struct pkginfo) + rec_info->host_triplet_len)
+    {
+        pthread_mutex_unlock(&db_lock);
+        // Most likely a torn write. The package is treated as clean, rather than as having no
+        // info, as callers take that to mean it was never built, and might not rebuild it.
+        fprintf(stderr, "%s: Corrupt package info for package %s. Treating the package as clean.\n", g_argv[0], pkg_name);
+        struct pkginfo* info = calloc(1, sizeof(struct pkginfo)+1);
+        info->build_state = BUILD_STATE_CLEAN;
+        return info;
+    }
+    struct pkginfo* info = malloc(rec->info_size+1);
+    memcpy(info, rec->info, rec->info_size);
+    pthread_mutex_unlock(&db_lock);
+    return info;
+}
+
+bool state_db_write(const char* pkg_name, const struct pkginfo* info)
+{
+    struct wal_entry ent = {.magic=STATE_WAL_ENTRY_MAGIC};
+    size_t name_len = strlen(pkg_name);
+    size_t info_size = sizeof(*info) + info->host_triplet_len;
+    if (name_len >= STATE_DB_NAME_MAX || info_size > sizeof(ent.record.info))
+    {
+        fprintf(stderr, "%s: Package info for package %s does not fit in the build state database\n", g_argv[0], pkg_name);
+        return false;
+    }
+    memcpy(ent.record.name, pkg_name, name_len);
+    memcpy(ent.record.info, info, info_size);
+    ent.record.info_size = info_size;
+    ent.record.checksum = record_checksum(&ent.record);
+
+    pthread_mutex_lock(&db_lock);
+    if (!open_db())
+    {
+        pthread_mutex_unlock(&db_lock);
+        return false;
+    }
+    flock(db_fd, LOCK_EX);
+    bool res = false;
+    // Another process might have grown the database.
+    if (!map_db())
+        goto out;
+    // Looked up with the database locked, so that no other process can take the same ID.
+    ent.id = find_record(pkg_name);
+    bool new_record = ent.id == UINT32_MAX;
+    if (new_record)
+        ent.id = db_header()->nRecords;
+    ent.checksum = wal_entry_checksum(&ent);
+    size_t nWritten = 0;
+    while (nWritten < sizeof(ent))
+    {
+        ssize_t ret = write(wal_fd, (char*)&ent + nWritten, sizeof(ent) - nWritten);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            goto out;
+        }
+        nWritten += ret;
+    }
+    if (!apply_record(ent.id, &ent.record))
+        goto out;
+    if (new_record)
+        index_records();
+    wal_appended++;
+    if (++nWalEntries >= STATE_WAL_MAX_ENTRIES)
+        checkpoint();
+    res = true;
+    out:
+    flock(db_fd, LOCK_UN);
+    pthread_mutex_unlock(&db_lock);
+    return res;
+}
+
+void state_db_sync()
+{
+    pthread_mutex_lock(&db_lock);
+    uint64_t target = wal_appended;
+    while (wal_synced < target && db_fd != -1)
+    {
+        if (wal_syncing)
+        {
+            // Another thread is already syncing, wait for it, then check whether it took
+            // our entries with it.
+            pthread_cond_wait(&wal_synced_cond, &db_lock);
+            continue;
+        }
+        // Become the leader, and sync everything appended up until now, including entries
+        // appended by other threads while we wait for the previous sync.
+        wal_syncing = true;
+        uint64_t batch = wal_appended;
+        int fd = wal_fd;
+        pthread_mutex_unlock(&db_lock);
+        if (fdatasync(fd) == -1)
+            perror("fdatasync");
+        pthread_mutex_lock(&db_lock);
+        wal_syncing = false;
+        if (batch > wal_synced)
+            wal_synced = batch;
+        pthread_cond_broadcast(&wal_synced_cond);
+    }
+    pthread_mutex_unlock(&db_lock);
+}
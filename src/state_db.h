@@ -0,0 +1,31 @@
+/*
+ * src/state_db.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "package.h"
+
+// The build state of every package is kept in a single database in pkg_info_directory,
+// made up of fixed-size records, one per package, which is mapped into memory.
+// Updates go through a write-ahead log (state.wal), which is applied to the database
+// every once in a while, and when the database is closed.
+// Old pkginfo_<name>.bin files are migrated into the database when it is created.
+
+// Returns a copy of the package's info, allocated with malloc, or NULL if the package has none.
+// If the package's record is corrupt, returns info for a clean package, so that it is rebuilt.
+struct pkginfo* state_db_read(const char* pkg_name);
+// Returns false on failure.
+// The record is updated atomically, but is not guaranteed to be on disk until state_db_sync.
+bool state_db_write(const char* pkg_name, const struct pkginfo* info);
+// Waits until every write made so far is on disk.
+// Concurrent callers share a single fdatasync of the log.
+void state_db_sync();
+// Applies the write-ahead log and unmaps the database.
+// It is reopened on the next call to state_db_read or state_db_write.
+// Called by main before exiting. Does nothing if the database is not open.
+void state_db_close();
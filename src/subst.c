@@ -0,0 +1,347 @@
+/*
+ * src/subst.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "subst.h"
+#include "package.h"
+#include "path.h"
+
+#define KEY_IS(lit) (len == sizeof(lit)-1 && memcmp(key, lit, sizeof(lit)-1) == 0)
+
+// Returns -1 if the key is unknown.
+static int lookup_key(const char* key, size_t len)
+{
+    if (!len)
+        return -1;
+    switch (len)
+    {
+        case 4:
+            if (KEY_IS("name")) return SUBST_KEY_NAME;
+            break;
+        case 5:
+            if (KEY_IS("nproc")) return SUBST_KEY_NPROC;
+            break;
+        case 6:
+            if (KEY_IS("prefix")) return SUBST_KEY_PREFIX;
+            break;
+        case 7:
+            if (key[0] == 'd' && KEY_IS("destdir")) return SUBST_KEY_DESTDIR;
+            if (key[0] == 'v' && KEY_IS("version")) return SUBST_KEY_VERSION;
+            break;
+        case 11:
+            if (key[0] == 'd' && KEY_IS("description")) return SUBST_KEY_DESCRIPTION;
+            if (key[0] == 'h' && KEY_IS("host_prefix")) return SUBST_KEY_HOST_PREFIX;
+            break;
+        case 12:
+            if (KEY_IS("host_triplet")) return SUBST_KEY_HOST_TRIPLET;
+            break;
+        case 13:
+            if (KEY_IS("target_prefix")) return SUBST_KEY_TARGET_PREFIX;
+            break;
+        case 14:
+            if (key[0] == 'r' && KEY_IS("repo_directory")) return SUBST_KEY_REPO_DIRECTORY;
+            if (key[0] == 'r' && KEY_IS("root_directory")) return SUBST_KEY_ROOT_DIRECTORY;
+            if (key[0] == 't' && KEY_IS("target_triplet")) return SUBST_KEY_TARGET_TRIPLET;
+            break;
+        case 18:
+            if (KEY_IS("bin_package_prefix")) return SUBST_KEY_BIN_PACKAGE_PREFIX;
+            break;
+        case 19:
+            if (KEY_IS("bootstrap_directory")) return SUBST_KEY_BOOTSTRAP_DIRECTORY;
+            break;
+        default:
+            break;
+    }
+    return -1;
+}
+
+#undef KEY_IS
+
+static bool key_needs_package(int key)
+{
+    switch (key)
+    {
+        case SUBST_KEY_NAME:
+        case SUBST_KEY_DESCRIPTION:
+        case SUBST_KEY_PREFIX:
+        case SUBST_KEY_VERSION:
+        case SUBST_KEY_BIN_PACKAGE_PREFIX:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static pthread_once_t nproc_once = PTHREAD_ONCE_INIT;
+static char nproc_str[16];
+
+static void init_nproc_str()
+{
+    snprintf(nproc_str, sizeof(nproc_str), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+static void append_segment(subst_template* tmpl, subst_segment* seg)
+{
+    tmpl->segments = realloc(tmpl->segments, (tmpl->cnt+1)*sizeof(subst_segment));
+    tmpl->segments[tmpl->cnt++] = *seg;
+}
+
+static void append_literal(subst_template* tmpl, const char* str, size_t len)
+{
+    if (!len)
+        return;
+    // Merge adjacent literals (e.g., around an escaped dollar sign).
+    if (tmpl->cnt && tmpl->segments[tmpl->cnt-1].type == SUBST_SEGMENT_LITERAL &&
+        tmpl->segments[tmpl->cnt-1].str + tmpl->segments[tmpl->cnt-1].len == str)
+    {
+        tmpl->segments[tmpl->cnt-1].len += len;
+        return;
+    }
+    subst_segment seg = {.type=SUBST_SEGMENT_LITERAL, .str=str, .len=len};
+    append_segment(tmpl, &seg);
+}
+
+int subst_compile(const char* str, const char* fieldname, subst_template* out)
+{
+    subst_template tmpl = {};
+    const char* literal = str;
+    const char* iter = str;
+    while (*iter)
+    {
+        if (*iter != '$' || !iter[1])
+        {
+            iter++;
+            continue;
+        }
+        const char* dollar_sign = iter;
+        append_literal(&tmpl, literal, dollar_sign - literal);
+        subst_segment seg = {.src=dollar_sign};
+        switch (dollar_sign[1])
+        {
+            case '$':
+            {
+                // Escape the dollar sign.
+                seg.type = SUBST_SEGMENT_LITERAL;
+                seg.str = dollar_sign;
+                seg.len = 1;
+                seg.src_len = 2;
+                break;
+            }
+            case '{':
+            {
+                const char* key = dollar_sign + 2;
+                const char* end = strchr(key, '}');
+                if (!end)
+                {
+                    printf("%s: In field '%s': Syntax error trying to substitute %s", g_argv[0], fieldname, dollar_sign);
+                    subst_template_free(&tmpl);
+                    return -1;
+                }
+                seg.type = SUBST_SEGMENT_KEY;
+                seg.key = lookup_key(key, end - key);
+                seg.src_len = (end - dollar_sign) + 1;
+                if (seg.key == -1)
+                {
+                    printf("%s: In field '%s': Invalid substitution key '%s', aborting.\n", g_argv[0], fieldname, dollar_sign);
+                    subst_template_free(&tmpl);
+                    return -1;
+                }
+                break;
+            }
+            default:
+            {
+                // Environment variable substitution.
+                const char* name = dollar_sign + 1;
+                const char* end = name;
+                while (*end && !isspace(*end))
+                    end++;
+                seg.type = SUBST_SEGMENT_ENV;
+                seg.str = name;
+                seg.len = end - name;
+                seg.src_len = (end - dollar_sign);
+                break;
+            }
+        }
+        if (seg.type == SUBST_SEGMENT_LITERAL)
+            append_literal(&tmpl, seg.str, seg.len);
+        else
+            append_segment(&tmpl, &seg);
+        iter = dollar_sign + seg.src_len;
+        literal = iter;
+    }
+    append_literal(&tmpl, literal, iter - literal);
+    *out = tmpl;
+    return 0;
+}
+
+void subst_template_free(subst_template* tmpl)
+{
+    free(tmpl->segments);
+    tmpl->segments = NULL;
+    tmpl->cnt = 0;
+}
+
+// Resolves a key or environment variable segment.
+// buf is used for values that must be formatted.
+static const char* resolve_segment(const subst_segment* seg, const char* fieldname, package* pkg, char* buf, size_t szBuf)
+{
+    if (seg->type == SUBST_SEGMENT_ENV)
+    {
+        char* env = malloc(seg->len+1);
+        memcpy(env, seg->str, seg->len);
+        env[seg->len] = 0;
+        const char* val = getenv(env);
+        free(env);
+        if (!val)
+            printf("%s: In field '%s': Invalid environment variable '%s', aborting.\n", g_argv[0], fieldname, seg->src);
+        return val;
+    }
+
+    if (key_needs_package(seg->key) && !pkg)
+    {
+        printf("%s: In field '%s': Invalid substitution key '%s', aborting.\n", g_argv[0], fieldname, seg->src);
+        return NULL;
+    }
+    switch (seg->key)
+    {
+        case SUBST_KEY_BOOTSTRAP_DIRECTORY: return bootstrap_directory;
+        case SUBST_KEY_NAME: return pkg->name;
+        case SUBST_KEY_DESCRIPTION: return pkg->description ? pkg->description : "";
+        case SUBST_KEY_REPO_DIRECTORY: return repo_directory;
+        case SUBST_KEY_ROOT_DIRECTORY: return root_directory;
+        case SUBST_KEY_PREFIX: return pkg->host_package ? host_prefix_directory : prefix_directory;
+        case SUBST_KEY_HOST_PREFIX: return host_prefix_directory;
+        case SUBST_KEY_TARGET_PREFIX: return prefix_directory;
+        case SUBST_KEY_DESTDIR:
+            // Target packages are installed into a staging directory, which is merged into destdir afterwards.
+            if (pkg && !pkg->host_package && strcmp(fieldname, "install-commands") == 0)
+                return package_make_staging_directory(pkg);
+            return destination_directory;
+        case SUBST_KEY_NPROC:
+            pthread_once(&nproc_once, init_nproc_str);
+            return nproc_str;
+        case SUBST_KEY_TARGET_TRIPLET: return g_config.target_triplet;
+        case SUBST_KEY_HOST_TRIPLET: return g_config.host_triplet;
+        case SUBST_KEY_BIN_PACKAGE_PREFIX:
+            return package_make_bin_prefix(pkg);
+        case SUBST_KEY_VERSION:
+            snprintf(buf, szBuf, "%u.%u.%u", pkg->version.major, pkg->version.minor, pkg->version.patch);
+            return buf;
+        default:
+            assert(!"unreachable");
+            return NULL;
+    }
+}
+
+char* subst_expand(const subst_template* tmpl, const char* fieldname, package* pkg, string_array* used_env)
+{
+    // Values of every segment, so that the output can be sized up front.
+    const char* values_stack[16];
+    size_t lengths_stack[16];
+    const char** values = values_stack;
+    size_t* lengths = lengths_stack;
+    if (tmpl->cnt > 16)
+    {
+        values = malloc(tmpl->cnt*sizeof(*values));
+        lengths = malloc(tmpl->cnt*sizeof(*lengths));
+    }
+    char version_buf[16];
+
+    char* res = NULL;
+    size_t total_len = 0;
+    for (size_t i = 0; i < tmpl->cnt; i++)
+    {
+        const subst_segment* seg = &tmpl->segments[i];
+        if (seg->type == SUBST_SEGMENT_LITERAL)
+        {
+            values[i] = seg->str;
+            lengths[i] = seg->len;
+        }
+        else
+        {
+            values[i] = resolve_segment(seg, fieldname, pkg, version_buf, sizeof(version_buf));
+            if (!values[i])
+                goto done;
+            lengths[i] = strlen(values[i]);
+#ifndef NDEBUG
+            printf("DEBUG: Substituition of %.*s with %.*s\n", (int)seg->src_len, seg->src, (int)lengths[i], values[i]);
+#endif
+            if (seg->type == SUBST_SEGMENT_ENV && used_env)
+            {
+                char* env = malloc(seg->len+1);
+                memcpy(env, seg->str, seg->len);
+                env[seg->len] = 0;
+                string_array_append(used_env, env);
+                string_array_append(used_env, values[i]);
+                free(env);
+            }
+        }
+        total_len += lengths[i];
+    }
+
+    res = pkg ? arena_alloc(&pkg->arena, total_len+1) : malloc(total_len+1);
+    char* out = res;
+    for (size_t i = 0; i < tmpl->cnt; i++)
+    {
+        memcpy(out, values[i], lengths[i]);
+        out += lengths[i];
+    }
+    *out = 0;
+
+    done:
+    if (values != values_stack)
+    {
+        free(values);
+        free(lengths);
+    }
+    return res;
+}
+
+char* subst_string(const char* str, const char* fieldname, package* pkg, string_array* used_env)
+{
+    subst_template tmpl = {};
+    if (subst_compile(str, fieldname, &tmpl) != 0)
+        return NULL;
+    char* res = subst_expand(&tmpl, fieldname, pkg, used_env);
+    subst_template_free(&tmpl);
+    return res;
+}
+
+bool subst_mentions_key(const char* str, size_t len, int key)
+{
+    const char* end = str + len;
+    for (const char* iter = str; iter + 1 < end; iter++)
+    {
+        if (*iter != '$')
+            continue;
+        // An escaped dollar sign.
+        if (iter[1] == '$')
+        {
+            iter++;
+            continue;
+        }
+        if (iter[1] != '{')
+            continue;
+        const char* key_start = iter + 2;
+        const char* key_end = memchr(key_start, '}', end - key_start);
+        if (!key_end)
+            return false;
+        if (lookup_key(key_start, key_end - key_start) == key)
+            return true;
+        iter = key_end;
+    }
+    return false;
+}
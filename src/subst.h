@@ -0,0 +1,72 @@
+/*
+ * src/subst.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "package.h"
+
+// Substitution of ${key}, $ENV, and $$ in recipe strings.
+// A template is compiled once into a list of segments, and can then
+// be expanded in a single pass into one pre-sized buffer.
+
+enum {
+    SUBST_SEGMENT_LITERAL,
+    SUBST_SEGMENT_KEY,
+    SUBST_SEGMENT_ENV,
+};
+
+enum {
+    SUBST_KEY_BOOTSTRAP_DIRECTORY,
+    SUBST_KEY_NAME,
+    SUBST_KEY_DESCRIPTION,
+    SUBST_KEY_REPO_DIRECTORY,
+    SUBST_KEY_ROOT_DIRECTORY,
+    SUBST_KEY_PREFIX,
+    SUBST_KEY_HOST_PREFIX,
+    SUBST_KEY_TARGET_PREFIX,
+    SUBST_KEY_DESTDIR,
+    SUBST_KEY_NPROC,
+    SUBST_KEY_TARGET_TRIPLET,
+    SUBST_KEY_HOST_TRIPLET,
+    SUBST_KEY_BIN_PACKAGE_PREFIX,
+    SUBST_KEY_VERSION,
+};
+
+typedef struct subst_segment {
+    int type;
+    // For literals, the text to copy. For environment variables, the variable's name.
+    // Points into the template string.
+    const char* str;
+    size_t len;
+    // For keys, the SUBST_KEY_* value.
+    int key;
+    // The text that was replaced (e.g., ${name}), for diagnostics.
+    const char* src;
+    size_t src_len;
+} subst_segment;
+
+typedef struct subst_template {
+    subst_segment* segments;
+    size_t cnt;
+} subst_template;
+
+// NOTE: The template refers to str, which must outlive it.
+// Returns non-zero on a syntax error, or an unknown key.
+int subst_compile(const char* str, const char* fieldname, subst_template* out);
+// Returns NULL on failure (e.g., a missing environment variable, or a package key when pkg is NULL).
+// The result is allocated from pkg's arena, or with malloc if pkg is NULL.
+// If used_env is non-NULL, every environment variable substituted is appended to it,
+// as a (name, value) pair.
+char* subst_expand(const subst_template* tmpl, const char* fieldname, package* pkg, string_array* used_env);
+void subst_template_free(subst_template* tmpl);
+
+// Compiles and expands str.
+char* subst_string(const char* str, const char* fieldname, package* pkg, string_array* used_env);
+// Returns true if the first len characters of str substitute key (a SUBST_KEY_* value) anywhere.
+// str does not have to be a single string (e.g., it can be a JSON array of strings).
+bool subst_mentions_key(const char* str, size_t len, int key);
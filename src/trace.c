@@ -0,0 +1,179 @@
+/*
+ * src/trace.c
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <threads.h>
+
+#include "trace.h"
+
+// Events are written as they happen, so that the trace of a run that crashed is still mostly readable.
+static FILE* trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_epoch;
+static bool first_event;
+static thread_local unsigned trace_lane;
+
+static uint64_t us_since_epoch(struct timespec ts)
+{
+    int64_t us = (int64_t)(ts.tv_sec - trace_epoch.tv_sec)*1000000 + (ts.tv_nsec - trace_epoch.tv_nsec)/1000;
+    return us > 0 ? (uint64_t)us : 0;
+}
+
+uint64_t trace_now()
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return us_since_epoch(now);
+}
+
+bool trace_active()
+{
+    return trace_file != NULL;
+}
+
+// Writes str as a JSON string.
+static void write_string(const char* str)
+{
+    fputc('"', trace_file);
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(trace_file, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(trace_file, "\\u%04x", *c);
+        else
+            fputc(*c, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+// Starts an event, which the caller finishes with "}".
+// Must be called with trace_lock held.
+static void begin_event(const char* name, const char* cat, const char* ph, uint64_t ts)
+{
+    fputs(first_event ? "\n" : ",\n", trace_file);
+    first_event = false;
+    fputs("{\"name\":", trace_file);
+    write_string(name);
+    fputs(",\"cat\":", trace_file);
+    write_string(cat);
+    fprintf(trace_file, ",\"ph\":\"%s\",\"ts\":%"PRIu64",\"pid\":1,\"tid\":%u", ph, ts, trace_lane);
+}
+
+bool trace_open(const char* path)
+{
+    trace_file = fopen(path, "w");
+    if (!trace_file)
+    {
+        perror("fopen");
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", trace_file);
+    first_event = true;
+    trace_lane = 0;
+    return true;
+}
+
+void trace_close()
+{
+    if (!trace_file)
+        return;
+    fputs("\n]}\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+void trace_set_lane(unsigned lane, const char* name)
+{
+    trace_lane = lane;
+    if (!trace_file)
+        return;
+    size_t len = snprintf(NULL, 0, "%s %u", name, lane);
+    char* lane_name = malloc(len+1);
+    snprintf(lane_name, len+1, "%s %u", name, lane);
+    pthread_mutex_lock(&trace_lock);
+    begin_event("thread_name", "__metadata", "M", 0);
+    fputs(",\"args\":{\"name\":", trace_file);
+    write_string(lane_name);
+    fputs("}}", trace_file);
+    pthread_mutex_unlock(&trace_lock);
+    free(lane_name);
+}
+
+// Must be called with trace_lock held.
+static void write_span_args(const char* pkg_name, const char* released_by, bool succeeded)
+{
+    fputs(",\"args\":{\"package\":", trace_file);
+    write_string(pkg_name);
+    if (released_by)
+    {
+        fputs(",\"released_by\":", trace_file);
+        write_string(released_by);
+    }
+    fprintf(trace_file, ",\"succeeded\":%s}}", succeeded ? "true" : "false");
+}
+
+void trace_stage(const char* stage, const char* pkg_name, struct timespec start, bool succeeded)
+{
+    if (!trace_file)
+        return;
+    uint64_t ts = us_since_epoch(start);
+    uint64_t end = trace_now();
+    pthread_mutex_lock(&trace_lock);
+    begin_event(stage, "stage", "X", ts);
+    fprintf(trace_file, ",\"dur\":%"PRIu64, end > ts ? end - ts : 0);
+    write_span_args(pkg_name, NULL, succeeded);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_package(const char* pkg_name, uint64_t start, const char* released_by, bool succeeded)
+{
+    if (!trace_file)
+        return;
+    uint64_t end = trace_now();
+    pthread_mutex_lock(&trace_lock);
+    begin_event(pkg_name, "package", "X", start);
+    fprintf(trace_file, ",\"dur\":%"PRIu64, end > start ? end - start : 0);
+    write_span_args(pkg_name, released_by, succeeded);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Writes a flow event, ph being "s" or "f".
+static void write_flow(const char* ph, uint64_t id, const char* dependency, const char* dependant, uint64_t ts)
+{
+    if (!trace_file)
+        return;
+    size_t len = snprintf(NULL, 0, "%s -> %s", dependency, dependant);
+    char* name = malloc(len+1);
+    snprintf(name, len+1, "%s -> %s", dependency, dependant);
+    pthread_mutex_lock(&trace_lock);
+    begin_event(name, "dependency", ph, ts);
+    // Flow ends bind to the span starting at ts, rather than the next one.
+    fprintf(trace_file, ",\"id\":%"PRIu64"%s}", id, *ph == 'f' ? ",\"bp\":\"e\"" : "");
+    pthread_mutex_unlock(&trace_lock);
+    free(name);
+}
+
+void trace_flow_start(uint64_t id, const char* dependency, const char* dependant, uint64_t ts)
+{
+    write_flow("s", id, dependency, dependant, ts);
+}
+
+void trace_flow_end(uint64_t id, const char* dependency, const char* dependant, uint64_t ts)
+{
+    write_flow("f", id, dependency, dependant, ts);
+}
@@ -0,0 +1,41 @@
+/*
+ * src/trace.h
+ *
+ * Copyright (c) 2025 Omar Berrow
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// A timeline of a build, in the trace event format (viewable in Perfetto or chrome://tracing).
+// Every thread building packages has a lane, on which the stages it runs appear as spans.
+// Flows connect the package whose build released another (that is, its last dependency
+// to be built) to that package.
+// Nothing is recorded unless trace_open was called, so the functions below are cheap to
+// call unconditionally.
+
+// Starts writing a trace to path. Returns false on failure.
+bool trace_open(const char* path);
+// Finishes the trace, and closes the file.
+void trace_close();
+bool trace_active();
+// Sets the lane of the calling thread, which is named after name and lane.
+// Threads that never call this are on lane zero.
+void trace_set_lane(unsigned lane, const char* name);
+// Returns the time since the trace was opened, in microseconds.
+uint64_t trace_now();
+// Records a span on the lane of the calling thread, from start (taken from CLOCK_MONOTONIC)
+// until now.
+void trace_stage(const char* stage, const char* pkg_name, struct timespec start, bool succeeded);
+// Records a span from start (see trace_now) until now, for building pkg_name.
+// released_by is the dependency whose build released the package, or NULL.
+void trace_package(const char* pkg_name, uint64_t start, const char* released_by, bool succeeded);
+// Starts and finishes a flow from the dependency that released a package to the package.
+// id must be unique to the flow, and ts is as from trace_now.
+// The flow starts in the span enclosing ts on the lane of the calling thread, and ends
+// in the span starting at ts on the lane of the calling thread.
+void trace_flow_start(uint64_t id, const char* dependency, const char* dependant, uint64_t ts);
+void trace_flow_end(uint64_t id, const char* dependency, const char* dependant, uint64_t ts);
@@ -4,49 +4,232 @@
  * Copyright (c) 2025 Omar Berrow
  */
 
+#define _DEFAULT_SOURCE
+
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "package.h"
+#include "path.h"
+#include "lock.h"
+#include "recipe_cache.h"
+#include "parallel.h"
+#include "graph.h"
+#include "buildall.h"
+
+// Runs cmd in a shell, and returns the lines it printed, or false if it failed.
+static bool read_command_output(const char* cmd, string_array* lines)
+{
+    FILE* pipe = popen(cmd, "r");
+    if (!pipe)
+    {
+        perror("popen");
+        return false;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len = 0;
+    while ((len = getline(&line, &cap, pipe)) != -1)
+    {
+        while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = 0;
+        if (len)
+            string_array_append(lines, line);
+    }
+    free(line);
+    return pclose(pipe) == 0;
+}
+
+// Returns the names of the recipes that changed since commit, which must be a commit hash.
+static bool changed_recipes(const char* commit, string_array* names)
+{
+    // git prints paths relative to the current directory (the root directory) with --relative.
+    const char* recipes_prefix = "recipes/";
+    char* recipes_prefix_buf = NULL;
+    size_t root_len = strlen(root_directory);
+    if (strncmp(recipes_directory, root_directory, root_len) == 0 && recipes_directory[root_len] == '/')
+    {
+        size_t len = snprintf(NULL, 0, "%s/", recipes_directory + root_len + 1);
+        recipes_prefix_buf = malloc(len+1);
+        snprintf(recipes_prefix_buf, len+1, "%s/", recipes_directory + root_len + 1);
+        recipes_prefix = recipes_prefix_buf;
+    }
+    size_t prefix_len = strlen(recipes_prefix);
+
+    size_t len = snprintf(NULL, 0, "git diff --name-only --relative %s", commit);
+    char* cmd = malloc(len+1);
+    snprintf(cmd, len+1, "git diff --name-only --relative %s", commit);
+    string_array paths = {};
+    bool res = read_command_output(cmd, &paths);
+    free(cmd);
+    for (size_t i = 0; res && i < paths.cnt; i++)
+    {
+        const char* path = paths.buf[i];
+        size_t path_len = strlen(path);
+        if (strncmp(path, recipes_prefix, prefix_len) != 0 || path_len <= prefix_len + 5 || strcmp(path + path_len - 5, ".json") != 0)
+            continue;
+        // Recipes in subdirectories are not packages.
+        if (memchr(path + prefix_len, '/', path_len - prefix_len))
+            continue;
+        char* name = strndup(path + prefix_len, path_len - prefix_len - 5);
+        string_array_append(names, name);
+        free(name);
+    }
+    string_array_free(&paths);
+    free(recipes_prefix_buf);
+    return res;
+}
 
-#include <sys/stat.h>
-
-static const char update_script[] =
-"#!/bin/bash\n\
-OLD_HEAD=`git log --pretty=format:'%H' -n 1`\n\
-git pull\n\
-UPDATED=`git diff --name-only $OLD_HEAD`\n\
-IFS=$'\n\n'\n\
-for line in $UPDATED; do\n\
-    if [[ \"$line\" == \"recipes/\"* ]]; then\n\
-        PACKAGE=$line\n\
-        PACKAGE=${PACKAGE%%.json}\n\
-        PACKAGE=${PACKAGE#recipes/}\n\
-        ./obos-strap outdated $PACKAGE\n\
-        if [[ $? -eq 0 ]];\n\
-        then\n\
-            ./obos-strap install $PACKAGE\n\
-        fi\n\
-    fi\n\
-done\n\
-unset IFS";
+typedef struct update_ctx {
+    package_graph* graph;
+    const pkg_id* ids;
+    // Indexed like ids.
+    bool* outdated;
+    bool* installed;
+    const uint64_t* changed;
+} update_ctx;
+
+// Called in parallel, for every package that was changed, or that depends on one that was.
+static void check_package(size_t i, void* udata)
+{
+    update_ctx* ctx = udata;
+    pkg_id id = ctx->ids[i];
+    const char* name = package_graph_name(ctx->graph, id);
+    package* pkg = get_package(name);
+    if (!pkg)
+        return;
+    struct pkginfo* info = read_package_info_ex(name, false, false);
+    ctx->installed[i] = info && info->build_state == BUILD_STATE_INSTALLED;
+    // Packages that were never built are only outdated if their recipe changed.
+    if (info)
+        ctx->outdated[i] = package_outdated(pkg, info, BUILD_STATE_INSTALLED);
+    else
+        ctx->outdated[i] = bitset_test(ctx->changed, id);
+    free(info);
+}
 
 void update()
 {
+    lock();
     printf("Updating packages\n");
-    char temp[] = { "./obos-strap-XXXXXX" };
-    int file = mkstemp(temp);
-    write(file, update_script, sizeof(update_script));
-    struct stat st = {};
-    stat(temp, &st);
-    chmod(temp, st.st_mode | S_IXUSR);
+    fflush(stdout);
+
+    string_array head = {};
+    if (!read_command_output("git rev-parse HEAD", &head) || head.cnt != 1)
+    {
+        printf("%s: Could not get the current commit of the repository\n", g_argv[0]);
+        string_array_free(&head);
+        unlock();
+        return;
+    }
+
     string_array argv = {};
-    string_array_append(&argv, temp);
-    close(file);
-    run_command(temp, argv);
+    string_array_append(&argv, "git");
+    string_array_append(&argv, "pull");
+    int ec = run_command("git", argv);
     string_array_free(&argv);
-    remove(temp);
+    if (ec != 0)
+    {
+        printf("%s: git pull failed with code %d\n", g_argv[0], ec);
+        string_array_free(&head);
+        unlock();
+        return;
+    }
+
+    string_array names = {};
+    bool got_changes = changed_recipes(head.buf[0], &names);
+    string_array_free(&head);
+    if (!got_changes)
+    {
+        printf("%s: Could not get the recipes changed by git pull\n", g_argv[0]);
+        string_array_free(&names);
+        unlock();
+        return;
+    }
+
+    // Read after pulling, so that the index is brought up to date with the new recipes.
+    package_graph graph = {};
+    package_graph_init(&graph, get_recipe_index());
+    uint64_t* changed = bitset_alloc(graph.cnt);
+    size_t nChanged = 0;
+    for (size_t i = 0; i < names.cnt; i++)
+    {
+        pkg_id id = package_graph_find(&graph, names.buf[i]);
+        // Removed recipes have no id.
+        if (id == PKG_ID_INVALID || bitset_test(graph.broken, id))
+            continue;
+        bitset_set(changed, id);
+        nChanged++;
+    }
+    string_array_free(&names);
+    if (!nChanged)
+    {
+        printf("No recipes were changed.\n");
+        free(changed);
+        package_graph_free(&graph);
+        unlock();
+        return;
+    }
+
+    // Installed dependants of changed packages are rebuilt if the output of their dependencies changes
+    // (see package_dependency_output_hash), which is only known once they are rebuilt.
+    uint64_t* affected = bitset_alloc(graph.cnt);
+    memcpy(affected, changed, BITSET_WORDS(graph.cnt)*sizeof(uint64_t));
+    package_graph_reverse_closure(&graph, affected);
+
+    pkg_id* ids = malloc((graph.cnt ? graph.cnt : 1)*sizeof(pkg_id));
+    size_t nIds = 0;
+    for (pkg_id id = 0; id < graph.cnt; id++)
+        if (bitset_test(affected, id) && !bitset_test(graph.broken, id))
+            ids[nIds++] = id;
+    update_ctx ctx = {
+        .graph=&graph,
+        .ids=ids,
+        .outdated=calloc(nIds ? nIds : 1, sizeof(bool)),
+        .installed=calloc(nIds ? nIds : 1, sizeof(bool)),
+        .changed=changed,
+    };
+    parallel_for(nIds, check_package, &ctx);
+
+    uint64_t* to_build = bitset_alloc(graph.cnt);
+    size_t nOutdated = 0, nDependants = 0;
+    for (size_t i = 0; i < nIds; i++)
+    {
+        if (ctx.outdated[i])
+        {
+            printf("%s is outdated\n", package_graph_name(&graph, ids[i]));
+            bitset_set(to_build, ids[i]);
+            nOutdated++;
+        }
+        else if (ctx.installed[i] && !bitset_test(changed, ids[i]))
+        {
+            bitset_set(to_build, ids[i]);
+            nDependants++;
+        }
+    }
+    free(ctx.outdated);
+    free(ctx.installed);
+    free(ids);
+    free(affected);
+    free(changed);
+
+    if (nOutdated)
+    {
+        printf("Updating %zu package(s), and checking %zu installed dependant(s)\n", nOutdated, nDependants);
+        fflush(stdout);
+        // Dependencies are built (if needed) first.
+        package_graph_closure(&graph, to_build);
+        build_package_set(&graph, to_build, false);
+    }
+    else
+        printf("Every package is up to date.\n");
+
+    free(to_build);
+    package_graph_free(&graph);
+    unlock();
 }